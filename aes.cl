@@ -1,5 +1,12 @@
+// Nr is fixed when the program is built: -DROUND=12 for AES-192, 14 for AES-256
+#ifndef ROUND
 #define ROUND 10
+#endif
 #define MAX_WIDTH 16
+// lines per work-item of the wide kernels: -DBLOCKS=4, 8 or 16
+#ifndef BLOCKS
+#define BLOCKS 4
+#endif
 
 __constant uchar sbox[256] = {
   0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
@@ -117,19 +124,6 @@ uchar xtime(uchar x){
   return ((x<<1) ^ (((x>>7) & 1) * 0x1b));
 }
 
-uchar multiply (uchar x, uchar y) {    
-   uchar c = 0;
-   uchar d = y;
-   for (int i = 0; i < MAX_WIDTH / 2; i++) {
-      if (x % 2 == 1) {
-        c ^= d;
-      }
-      x /= 2;
-      d = xtime(d);
-   }
-   return c;
-}
-
 void mixColumns (__global uchar* state) {
     uchar a, b, c, d, temp, foo;
   for (int i = 0; i < 4; i++) {  
@@ -159,20 +153,22 @@ void mixColumns (__global uchar* state) {
   }
 }
 
+/**
+ * InvMixColumns as a pre-step of MixColumns:
+ * a_r ^= 4 * (a_r ^ a_{r+2}), then MixColumns. Only xtime is needed, which is
+ * a few gates instead of the bit-serial multiply loop.
+ */
 void invMixColumns (__global uchar* state) {
-    uchar a, b, c, d;
+    uchar u, v;
   for (int i = 0; i < 4; i++) {  
-    a = state[4 * i + 0];
-    b = state[4 * i + 1];
-    c = state[4 * i + 2];
-    d = state[4 * i + 3];
-
-    state[4 * i + 0] = multiply(a, 0x0e) ^ multiply(b, 0x0b) ^ multiply(c, 0x0d) ^ multiply(d, 0x09);
-    state[4 * i + 1] = multiply(a, 0x09) ^ multiply(b, 0x0e) ^ multiply(c, 0x0b) ^ multiply(d, 0x0d);
-    state[4 * i + 2] = multiply(a, 0x0d) ^ multiply(b, 0x09) ^ multiply(c, 0x0e) ^ multiply(d, 0x0b);
-    state[4 * i + 3] = multiply(a, 0x0b) ^ multiply(b, 0x0d) ^ multiply(c, 0x09) ^ multiply(d, 0x0e);
-
+    u = xtime(xtime(state[4 * i + 0] ^ state[4 * i + 2]));
+    v = xtime(xtime(state[4 * i + 1] ^ state[4 * i + 3]));
+    state[4 * i + 0] ^= u;
+    state[4 * i + 1] ^= v;
+    state[4 * i + 2] ^= u;
+    state[4 * i + 3] ^= v;
   }
+  mixColumns(state);
 }
 
 void addRoundKey (__global uchar* state, __global uchar* roundKey) {
@@ -184,7 +180,8 @@ void addRoundKey (__global uchar* state, __global uchar* roundKey) {
 void encryption (__global uchar* state, __global uchar* key) {
   
   addRoundKey(state, key);
-  for(int i = 0; i < ROUND; i++){
+  #pragma unroll
+  for(int i = 0; i < ROUND - 1; i++){
       subBytes(state);
       shiftRows(state);
       mixColumns(state);
@@ -199,6 +196,7 @@ void decryption (__global uchar* state, __global uchar* key) {
     // the inverse order of encryption
     // the final round does not include the mixColumns transformation
     addRoundKey(state, key + MAX_WIDTH * ROUND);
+    #pragma unroll
     for (int i = ROUND - 2; i >= 0; i--) {
         invShiftRows(state);
         invSubBytes(state);
@@ -210,6 +208,156 @@ void decryption (__global uchar* state, __global uchar* key) {
     addRoundKey(state, key);
 }
 
+/**
+ * Private-memory versions of the round steps, for kernels that build their
+ * state in registers instead of reading it from global memory
+ */
+void subBytesPrivate (uchar* state) {
+    for (int i = 0; i < MAX_WIDTH; i++) {
+        state[i] = sbox[state[i]];
+    }
+}
+
+void shiftRowsPrivate (uchar* state) {
+    uchar temp;
+    temp = state[1];
+    state[1] = state[5];
+    state[5] = state[9];
+    state[9] = state[13];
+    state[13] = temp;
+
+    temp = state[2];
+    state[2] = state[10];
+    state[10] = temp;
+
+    temp = state[6];
+    state[6] = state[14];
+    state[14] = temp;
+
+    temp = state[3];
+    state[3] = state[15];
+    state[15] = state[11];
+    state[11] = state[7];
+    state[7] = temp;
+}
+
+void mixColumnsPrivate (uchar* state) {
+    uchar a, b, c, d, temp;
+  for (int i = 0; i < 4; i++) {  
+    a = state[4 * i + 0];
+    b = state[4 * i + 1];
+    c = state[4 * i + 2];
+    d = state[4 * i + 3];
+
+    temp = a ^ b ^ c ^ d;
+    state[4 * i + 0] ^= xtime(a ^ b) ^ temp;
+    state[4 * i + 1] ^= xtime(b ^ c) ^ temp;
+    state[4 * i + 2] ^= xtime(c ^ d) ^ temp;
+    state[4 * i + 3] ^= xtime(d ^ a) ^ temp;
+  }
+}
+
+void addRoundKeyPrivate (uchar* state, __global uchar* roundKey) {
+    for (int i = 0; i < MAX_WIDTH; i++) {
+        state[i] ^= roundKey[i];
+    }
+}
+
+void encryptionPrivate (uchar* state, __global uchar* key) {
+  addRoundKeyPrivate(state, key);
+  #pragma unroll
+  for(int i = 0; i < ROUND - 1; i++){
+      subBytesPrivate(state);
+      shiftRowsPrivate(state);
+      mixColumnsPrivate(state);
+      addRoundKeyPrivate(state, key + (MAX_WIDTH * (i + 1)));
+  }
+  subBytesPrivate(state);
+  shiftRowsPrivate(state); 
+  addRoundKeyPrivate(state, key + MAX_WIDTH * ROUND);
+}
+
+void invSubBytesPrivate (uchar* state) {
+    for (int i = 0; i < MAX_WIDTH; i++) {
+        state[i] = rsbox[state[i]];
+    }
+}
+
+void invShiftRowsPrivate (uchar* state) {
+    uchar temp;
+    temp = state[1];
+    state[1] = state[13];
+    state[13] = state[9];
+    state[9] = state[5];
+    state[5] = temp;
+
+    temp = state[2];
+    state[2] = state[10];
+    state[10] = temp;
+
+    temp = state[6];
+    state[6] = state[14];
+    state[14] = temp;
+
+    temp = state[3];
+    state[3] = state[7];
+    state[7] = state[11];
+    state[11] = state[15];
+    state[15] = temp;
+}
+
+void invMixColumnsPrivate (uchar* state) {
+    uchar u, v;
+  for (int i = 0; i < 4; i++) {
+    u = xtime(xtime(state[4 * i + 0] ^ state[4 * i + 2]));
+    v = xtime(xtime(state[4 * i + 1] ^ state[4 * i + 3]));
+    state[4 * i + 0] ^= u;
+    state[4 * i + 1] ^= v;
+    state[4 * i + 2] ^= u;
+    state[4 * i + 3] ^= v;
+  }
+  mixColumnsPrivate(state);
+}
+
+/**
+ * Round steps with the round key in private memory as well, every loop has
+ * a constant trip count so the rounds unroll into straight-line logic
+ */
+void addRoundKeyCached (uchar* state, const uchar* roundKey) {
+    #pragma unroll
+    for (int i = 0; i < MAX_WIDTH; i++) {
+        state[i] ^= roundKey[i];
+    }
+}
+
+void encryptionCached (uchar* state, const uchar* key) {
+  addRoundKeyCached(state, key);
+  #pragma unroll
+  for(int i = 0; i < ROUND - 1; i++){
+      subBytesPrivate(state);
+      shiftRowsPrivate(state);
+      mixColumnsPrivate(state);
+      addRoundKeyCached(state, key + (MAX_WIDTH * (i + 1)));
+  }
+  subBytesPrivate(state);
+  shiftRowsPrivate(state);
+  addRoundKeyCached(state, key + MAX_WIDTH * ROUND);
+}
+
+void decryptionCached (uchar* state, const uchar* key) {
+    addRoundKeyCached(state, key + MAX_WIDTH * ROUND);
+    #pragma unroll
+    for (int i = ROUND - 2; i >= 0; i--) {
+        invShiftRowsPrivate(state);
+        invSubBytesPrivate(state);
+        addRoundKeyCached(state, key + (MAX_WIDTH * (i + 1)));
+        invMixColumnsPrivate(state);
+    }
+    invShiftRowsPrivate(state);
+    invSubBytesPrivate(state);
+    addRoundKeyCached(state, key);
+}
+
 __kernel void encrypt(__global uchar* restrict message, __global uchar* restrict roundKey) {
   int id = get_global_id(0);
   encryption(message + 16 * id, roundKey);
@@ -218,4 +366,428 @@ __kernel void encrypt(__global uchar* restrict message, __global uchar* restrict
 __kernel void decrypt(__global uchar* restrict message, __global uchar* restrict roundKey) {
   int id = get_global_id(0);
   decryption(message + 16 * id, roundKey);
-}
\ No newline at end of file
+}
+
+/**
+ * Batches of messages with keys of their own, a work-item per line. keys
+ * holds the schedules MAX_KEY_SCHEDULE bytes apart and ids the key of every
+ * line of the share, NO_KEY for the lines between messages. The chunk
+ * starts at line first of the share.
+ */
+#define MAX_KEY_SCHEDULE (MAX_WIDTH * 15)
+#define NO_KEY 0xffffffff
+
+__kernel void encrypt_batch(__global uchar* restrict message, __global uchar* restrict keys,
+                            __global const uint* restrict ids, ulong first) {
+  size_t id = get_global_id(0);
+  uint k = ids[first + id];
+  if (k != NO_KEY) {
+    encryption(message + MAX_WIDTH * id, keys + (size_t)k * MAX_KEY_SCHEDULE);
+  }
+}
+
+__kernel void decrypt_batch(__global uchar* restrict message, __global uchar* restrict keys,
+                            __global const uint* restrict ids, ulong first) {
+  size_t id = get_global_id(0);
+  uint k = ids[first + id];
+  if (k != NO_KEY) {
+    decryption(message + MAX_WIDTH * id, keys + (size_t)k * MAX_KEY_SCHEDULE);
+  }
+}
+
+/**
+ * Single work-item versions of encrypt and decrypt, started with
+ * clEnqueueTask over lines lines. The round key is copied to private
+ * memory once, a line is one 16-byte load and store and its state stays
+ * in private memory through the unrolled rounds. Lines do not depend on
+ * each other, so the offline compiler pipelines the loop at II=1.
+ */
+__kernel void encrypt_pipe(__global uchar* restrict message, __global const uchar* restrict roundKey, uint lines) {
+  uchar key[MAX_WIDTH * (ROUND + 1)];
+  #pragma unroll
+  for (int i = 0; i < MAX_WIDTH * (ROUND + 1); i++) {
+    key[i] = roundKey[i];
+  }
+  #pragma ii 1
+  for (uint n = 0; n < lines; n++) {
+    uchar state[MAX_WIDTH];
+    vstore16(vload16(n, message), 0, state);
+    encryptionCached(state, key);
+    vstore16(vload16(0, state), n, message);
+  }
+}
+
+__kernel void decrypt_pipe(__global uchar* restrict message, __global const uchar* restrict roundKey, uint lines) {
+  uchar key[MAX_WIDTH * (ROUND + 1)];
+  #pragma unroll
+  for (int i = 0; i < MAX_WIDTH * (ROUND + 1); i++) {
+    key[i] = roundKey[i];
+  }
+  #pragma ii 1
+  for (uint n = 0; n < lines; n++) {
+    uchar state[MAX_WIDTH];
+    vstore16(vload16(n, message), 0, state);
+    decryptionCached(state, key);
+    vstore16(vload16(0, state), n, message);
+  }
+}
+
+/**
+ * BLOCKS consecutive lines per work-item, lines is the number of lines so
+ * the last work-item may hold fewer. Every line is a single 16-byte load
+ * and store, and the unrolled blocks give the compiler independent rounds
+ * to interleave.
+ */
+__kernel void encrypt_wide(__global uchar* restrict message, __global const uchar* restrict roundKey, uint lines) {
+  size_t first = get_global_id(0) * BLOCKS;
+  uchar key[MAX_WIDTH * (ROUND + 1)];
+  #pragma unroll
+  for (int i = 0; i < MAX_WIDTH * (ROUND + 1); i++) {
+    key[i] = roundKey[i];
+  }
+  #pragma unroll
+  for (int b = 0; b < BLOCKS; b++) {
+    if (first + b < lines) {
+      uchar state[MAX_WIDTH];
+      vstore16(vload16(first + b, message), 0, state);
+      encryptionCached(state, key);
+      vstore16(vload16(0, state), first + b, message);
+    }
+  }
+}
+
+__kernel void decrypt_wide(__global uchar* restrict message, __global const uchar* restrict roundKey, uint lines) {
+  size_t first = get_global_id(0) * BLOCKS;
+  uchar key[MAX_WIDTH * (ROUND + 1)];
+  #pragma unroll
+  for (int i = 0; i < MAX_WIDTH * (ROUND + 1); i++) {
+    key[i] = roundKey[i];
+  }
+  #pragma unroll
+  for (int b = 0; b < BLOCKS; b++) {
+    if (first + b < lines) {
+      uchar state[MAX_WIDTH];
+      vstore16(vload16(first + b, message), 0, state);
+      decryptionCached(state, key);
+      vstore16(vload16(0, state), first + b, message);
+    }
+  }
+}
+
+/**
+ * Local-memory T-table kernels. A work-group of LOCAL_GROUP work-items
+ * first builds the table and the round key in local memory, then every
+ * work-item runs a line with four table lookups per column and round.
+ * table holds copies interleaved tables, entry x of copy c is word
+ * x * copies + c, so the copies of an entry sit in different banks and
+ * neighbouring work-items, which use copy i % copies, do not conflict
+ * when they look up the same entry. The host passes
+ * copies * 1 KiB of local memory for table and (ROUND + 1) * 16 bytes for
+ * rk, and launches whole work-groups over lines lines.
+ */
+#ifndef LOCAL_GROUP
+#define LOCAL_GROUP 64
+#endif
+#define BYTE(w, n) (((w) >> (24 - 8 * (n))) & 0xff)
+
+uchar gmul (uchar a, uchar b) {
+    uchar p = 0;
+    for (int i = 0; i < 8; i++) {
+        if (b & 1) {
+            p ^= a;
+        }
+        a = xtime(a);
+        b >>= 1;
+    }
+    return p;
+}
+
+uint loadWord (__global const uchar* p) {
+    return ((uint)p[0] << 24) | ((uint)p[1] << 16) | ((uint)p[2] << 8) | (uint)p[3];
+}
+
+void storeWord (__global uchar* p, uint w) {
+    p[0] = (uchar)(w >> 24);
+    p[1] = (uchar)(w >> 16);
+    p[2] = (uchar)(w >> 8);
+    p[3] = (uchar)w;
+}
+
+// InvMixColumns of one column, for the round keys of the inverse cipher
+uint invMixWord (uint w) {
+    uchar a0 = BYTE(w, 0), a1 = BYTE(w, 1), a2 = BYTE(w, 2), a3 = BYTE(w, 3);
+    return ((uint)(gmul(a0, 14) ^ gmul(a1, 11) ^ gmul(a2, 13) ^ gmul(a3, 9)) << 24) |
+           ((uint)(gmul(a0, 9) ^ gmul(a1, 14) ^ gmul(a2, 11) ^ gmul(a3, 13)) << 16) |
+           ((uint)(gmul(a0, 13) ^ gmul(a1, 9) ^ gmul(a2, 14) ^ gmul(a3, 11)) << 8) |
+           (uint)(gmul(a0, 11) ^ gmul(a1, 13) ^ gmul(a2, 9) ^ gmul(a3, 14));
+}
+
+__kernel __attribute__((reqd_work_group_size(LOCAL_GROUP, 1, 1)))
+void encrypt_local(__global uchar* restrict message, __global const uchar* restrict roundKey, uint lines,
+                   uint copies, __local uint* table, __local uint* rk) {
+  size_t lid = get_local_id(0);
+  // T0[x] is the column (2s, s, s, 3s) of s = S(x), the other rows are rotations
+  for (size_t i = lid; i < 256 * copies; i += LOCAL_GROUP) {
+    uchar s = sbox[i / copies];
+    table[i] = ((uint)xtime(s) << 24) | ((uint)s << 16) | ((uint)s << 8) | (uint)(xtime(s) ^ s);
+  }
+  for (size_t i = lid; i < 4 * (ROUND + 1); i += LOCAL_GROUP) {
+    rk[i] = loadWord(roundKey + 4 * i);
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  size_t id = get_global_id(0);
+  if (id >= lines) {
+    return;
+  }
+  __local uint* t = table + lid % copies;
+  __global uchar* line = message + MAX_WIDTH * id;
+  uint w0 = loadWord(line) ^ rk[0];
+  uint w1 = loadWord(line + 4) ^ rk[1];
+  uint w2 = loadWord(line + 8) ^ rk[2];
+  uint w3 = loadWord(line + 12) ^ rk[3];
+  #pragma unroll
+  for (int r = 1; r < ROUND; r++) {
+    uint v0 = t[BYTE(w0, 0) * copies] ^ rotate(t[BYTE(w1, 1) * copies], 24u) ^ rotate(t[BYTE(w2, 2) * copies], 16u) ^ rotate(t[BYTE(w3, 3) * copies], 8u) ^ rk[4 * r];
+    uint v1 = t[BYTE(w1, 0) * copies] ^ rotate(t[BYTE(w2, 1) * copies], 24u) ^ rotate(t[BYTE(w3, 2) * copies], 16u) ^ rotate(t[BYTE(w0, 3) * copies], 8u) ^ rk[4 * r + 1];
+    uint v2 = t[BYTE(w2, 0) * copies] ^ rotate(t[BYTE(w3, 1) * copies], 24u) ^ rotate(t[BYTE(w0, 2) * copies], 16u) ^ rotate(t[BYTE(w1, 3) * copies], 8u) ^ rk[4 * r + 2];
+    uint v3 = t[BYTE(w3, 0) * copies] ^ rotate(t[BYTE(w0, 1) * copies], 24u) ^ rotate(t[BYTE(w1, 2) * copies], 16u) ^ rotate(t[BYTE(w2, 3) * copies], 8u) ^ rk[4 * r + 3];
+    w0 = v0; w1 = v1; w2 = v2; w3 = v3;
+  }
+  // the last round has no MixColumns, S(x) is the second byte of T0[x]
+  storeWord(line, ((BYTE(t[BYTE(w0, 0) * copies], 1) << 24) | (BYTE(t[BYTE(w1, 1) * copies], 1) << 16) |
+                   (BYTE(t[BYTE(w2, 2) * copies], 1) << 8) | BYTE(t[BYTE(w3, 3) * copies], 1)) ^ rk[4 * ROUND]);
+  storeWord(line + 4, ((BYTE(t[BYTE(w1, 0) * copies], 1) << 24) | (BYTE(t[BYTE(w2, 1) * copies], 1) << 16) |
+                       (BYTE(t[BYTE(w3, 2) * copies], 1) << 8) | BYTE(t[BYTE(w0, 3) * copies], 1)) ^ rk[4 * ROUND + 1]);
+  storeWord(line + 8, ((BYTE(t[BYTE(w2, 0) * copies], 1) << 24) | (BYTE(t[BYTE(w3, 1) * copies], 1) << 16) |
+                       (BYTE(t[BYTE(w0, 2) * copies], 1) << 8) | BYTE(t[BYTE(w1, 3) * copies], 1)) ^ rk[4 * ROUND + 2]);
+  storeWord(line + 12, ((BYTE(t[BYTE(w3, 0) * copies], 1) << 24) | (BYTE(t[BYTE(w0, 1) * copies], 1) << 16) |
+                        (BYTE(t[BYTE(w1, 2) * copies], 1) << 8) | BYTE(t[BYTE(w2, 3) * copies], 1)) ^ rk[4 * ROUND + 3]);
+}
+
+/**
+ * The equivalent inverse cipher with the same encryption round key, whose
+ * inner round keys get InvMixColumns while they are copied. The last round
+ * reads rsbox, once per line.
+ */
+__kernel __attribute__((reqd_work_group_size(LOCAL_GROUP, 1, 1)))
+void decrypt_local(__global uchar* restrict message, __global const uchar* restrict roundKey, uint lines,
+                   uint copies, __local uint* table, __local uint* rk) {
+  size_t lid = get_local_id(0);
+  // T0[x] is the column (14s, 9s, 13s, 11s) of s = S^-1(x)
+  for (size_t i = lid; i < 256 * copies; i += LOCAL_GROUP) {
+    uchar s = rsbox[i / copies];
+    table[i] = ((uint)gmul(s, 14) << 24) | ((uint)gmul(s, 9) << 16) | ((uint)gmul(s, 13) << 8) | (uint)gmul(s, 11);
+  }
+  for (size_t i = lid; i < 4 * (ROUND + 1); i += LOCAL_GROUP) {
+    uint w = loadWord(roundKey + 4 * i);
+    rk[i] = i < 4 || i >= 4 * ROUND ? w : invMixWord(w);
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  size_t id = get_global_id(0);
+  if (id >= lines) {
+    return;
+  }
+  __local uint* t = table + lid % copies;
+  __global uchar* line = message + MAX_WIDTH * id;
+  uint w0 = loadWord(line) ^ rk[4 * ROUND];
+  uint w1 = loadWord(line + 4) ^ rk[4 * ROUND + 1];
+  uint w2 = loadWord(line + 8) ^ rk[4 * ROUND + 2];
+  uint w3 = loadWord(line + 12) ^ rk[4 * ROUND + 3];
+  #pragma unroll
+  for (int r = ROUND - 1; r > 0; r--) {
+    uint v0 = t[BYTE(w0, 0) * copies] ^ rotate(t[BYTE(w3, 1) * copies], 24u) ^ rotate(t[BYTE(w2, 2) * copies], 16u) ^ rotate(t[BYTE(w1, 3) * copies], 8u) ^ rk[4 * r];
+    uint v1 = t[BYTE(w1, 0) * copies] ^ rotate(t[BYTE(w0, 1) * copies], 24u) ^ rotate(t[BYTE(w3, 2) * copies], 16u) ^ rotate(t[BYTE(w2, 3) * copies], 8u) ^ rk[4 * r + 1];
+    uint v2 = t[BYTE(w2, 0) * copies] ^ rotate(t[BYTE(w1, 1) * copies], 24u) ^ rotate(t[BYTE(w0, 2) * copies], 16u) ^ rotate(t[BYTE(w3, 3) * copies], 8u) ^ rk[4 * r + 2];
+    uint v3 = t[BYTE(w3, 0) * copies] ^ rotate(t[BYTE(w2, 1) * copies], 24u) ^ rotate(t[BYTE(w1, 2) * copies], 16u) ^ rotate(t[BYTE(w0, 3) * copies], 8u) ^ rk[4 * r + 3];
+    w0 = v0; w1 = v1; w2 = v2; w3 = v3;
+  }
+  storeWord(line, (((uint)rsbox[BYTE(w0, 0)] << 24) | ((uint)rsbox[BYTE(w3, 1)] << 16) |
+                   ((uint)rsbox[BYTE(w2, 2)] << 8) | (uint)rsbox[BYTE(w1, 3)]) ^ rk[0]);
+  storeWord(line + 4, (((uint)rsbox[BYTE(w1, 0)] << 24) | ((uint)rsbox[BYTE(w0, 1)] << 16) |
+                       ((uint)rsbox[BYTE(w3, 2)] << 8) | (uint)rsbox[BYTE(w2, 3)]) ^ rk[1]);
+  storeWord(line + 8, (((uint)rsbox[BYTE(w2, 0)] << 24) | ((uint)rsbox[BYTE(w1, 1)] << 16) |
+                       ((uint)rsbox[BYTE(w0, 2)] << 8) | (uint)rsbox[BYTE(w3, 3)]) ^ rk[2]);
+  storeWord(line + 12, (((uint)rsbox[BYTE(w3, 0)] << 24) | ((uint)rsbox[BYTE(w2, 1)] << 16) |
+                        ((uint)rsbox[BYTE(w1, 2)] << 8) | (uint)rsbox[BYTE(w0, 3)]) ^ rk[3]);
+}
+
+/**
+ * CTR mode, the same kernel encrypts and decrypts
+ * Work-item i uses counter block (counterHi:counterLo) + i, the host folds
+ * the iv and the seek offset into the starting counter.
+ */
+__kernel void ctr_xcrypt(__global uchar* restrict message, __global uchar* restrict roundKey,
+                         ulong counterHi, ulong counterLo) {
+  size_t id = get_global_id(0);
+  ulong lo = counterLo + id;
+  ulong hi = counterHi + (lo < counterLo ? 1 : 0);
+  uchar block[MAX_WIDTH];
+  for (int i = 0; i < 8; i++) {
+    block[i] = (uchar)(hi >> (56 - 8 * i));
+    block[8 + i] = (uchar)(lo >> (56 - 8 * i));
+  }
+  encryptionPrivate(block, roundKey);
+  __global uchar* line = message + MAX_WIDTH * id;
+  for (int i = 0; i < MAX_WIDTH; i++) {
+    line[i] ^= block[i];
+  }
+}
+
+/**
+ * CBC decryption, one line per work-item
+ * cipher holds the iv followed by the ciphertext, so line i is chained to
+ * cipher[i] and decrypted from cipher[i + 1]. The result goes to message.
+ */
+__kernel void cbc_decrypt(__global uchar* restrict message, __global uchar* restrict roundKey,
+                          __global const uchar* restrict cipher) {
+  size_t id = get_global_id(0);
+  __global uchar* line = message + MAX_WIDTH * id;
+  __global const uchar* prev = cipher + MAX_WIDTH * id;
+  for (int i = 0; i < MAX_WIDTH; i++) {
+    line[i] = prev[MAX_WIDTH + i];
+  }
+  decryption(line, roundKey);
+  for (int i = 0; i < MAX_WIDTH; i++) {
+    line[i] ^= prev[i];
+  }
+}
+
+/**
+ * XTS tweak (hi:lo, little-endian halves) times x^n for 0 < n < 64
+ * The n bits shifted out are folded back with x^128 = x^7 + x^2 + x + 1.
+ */
+void xtsMulX (ulong* lo, ulong* hi, uint n) {
+  ulong c = *hi >> (64 - n);
+  *hi = (*hi << n) | (*lo >> (64 - n));
+  *lo = (*lo << n) ^ c ^ (c << 1) ^ (c << 2) ^ (c << 7);
+  *hi ^= (c >> 63) ^ (c >> 62) ^ (c >> 57);
+}
+
+/**
+ * The tweak of this work-item's line, one work-group per data unit
+ * Item 0 encrypts the unit number into scratch, every item then moves
+ * that tweak along by its line index in steps of up to 63 bits.
+ */
+void xtsTweak (__local ulong* scratch, __global uchar* tweakKey, ulong unit, uchar* t) {
+  if (get_local_id(0) == 0) {
+    uchar b[MAX_WIDTH];
+    for (int i = 0; i < 8; i++) {
+      b[i] = (uchar)(unit >> (8 * i));
+      b[8 + i] = 0;
+    }
+    encryptionPrivate(b, tweakKey);
+    ulong lo = 0, hi = 0;
+    for (int i = 7; i >= 0; i--) {
+      lo = (lo << 8) | b[i];
+      hi = (hi << 8) | b[8 + i];
+    }
+    scratch[0] = lo;
+    scratch[1] = hi;
+  }
+  barrier(CLK_LOCAL_MEM_FENCE);
+  ulong lo = scratch[0], hi = scratch[1];
+  for (uint j = get_local_id(0); j > 0; ) {
+    uint n = j < 63 ? j : 63;
+    xtsMulX(&lo, &hi, n);
+    j -= n;
+  }
+  for (int i = 0; i < 8; i++) {
+    t[i] = (uchar)(lo >> (8 * i));
+    t[8 + i] = (uchar)(hi >> (8 * i));
+  }
+}
+
+/**
+ * XTS over whole data units, the work-group size is the lines per unit
+ * and work-group g holds unit unit0 + g
+ */
+__kernel void xts_encrypt(__global uchar* restrict message, __global uchar* restrict roundKey,
+                          __global uchar* restrict tweakKey, ulong unit0, __local ulong* scratch) {
+  uchar t[MAX_WIDTH];
+  xtsTweak(scratch, tweakKey, unit0 + get_group_id(0), t);
+  __global uchar* line = message + MAX_WIDTH * get_global_id(0);
+  for (int i = 0; i < MAX_WIDTH; i++) {
+    line[i] ^= t[i];
+  }
+  encryption(line, roundKey);
+  for (int i = 0; i < MAX_WIDTH; i++) {
+    line[i] ^= t[i];
+  }
+}
+
+__kernel void xts_decrypt(__global uchar* restrict message, __global uchar* restrict roundKey,
+                          __global uchar* restrict tweakKey, ulong unit0, __local ulong* scratch) {
+  uchar t[MAX_WIDTH];
+  xtsTweak(scratch, tweakKey, unit0 + get_group_id(0), t);
+  __global uchar* line = message + MAX_WIDTH * get_global_id(0);
+  for (int i = 0; i < MAX_WIDTH; i++) {
+    line[i] ^= t[i];
+  }
+  decryption(line, roundKey);
+  for (int i = 0; i < MAX_WIDTH; i++) {
+    line[i] ^= t[i];
+  }
+}
+
+/**
+ * GF(2^128) multiplication for GHASH, blocks are (hi, lo) big-endian halves
+ */
+void gfMultiply (ulong xh, ulong xl, ulong yh, ulong yl, ulong* zh, ulong* zl) {
+  ulong rh = 0, rl = 0;
+  for (int i = 0; i < 128; i++) {
+    ulong bit = i < 64 ? (xh >> (63 - i)) & 1 : (xl >> (127 - i)) & 1;
+    ulong mask = 0 - bit;
+    rh ^= yh & mask;
+    rl ^= yl & mask;
+    ulong carry = 0 - (yl & 1);
+    yl = (yl >> 1) | (yh << 63);
+    yh = (yh >> 1) ^ (0xe100000000000000UL & carry);
+  }
+  *zh = rh;
+  *zl = rl;
+}
+
+/**
+ * GHASH reduction: every work-item hashes blocksPerItem lines with H, then the
+ * work-group folds its items pairwise, multiplying the left half by
+ * H^(blocksPerItem * s) when the halves are s items long. hpow holds H and
+ * those powers as (hi, lo) pairs. Item 0 writes the group's partial hash,
+ * the host chains the partials with one more power of H.
+ * The local size must be a power of two.
+ */
+__kernel void ghash_partial(__global const uchar* restrict data, __global const ulong* restrict hpow,
+                            __global ulong* restrict partial, uint blocksPerItem, __local ulong* scratch) {
+  size_t gid = get_global_id(0);
+  size_t lid = get_local_id(0);
+  size_t lsize = get_local_size(0);
+  ulong yh = 0, yl = 0;
+  __global const uchar* p = data + (size_t)MAX_WIDTH * blocksPerItem * gid;
+  for (uint b = 0; b < blocksPerItem; b++) {
+    ulong xh = 0, xl = 0;
+    for (int i = 0; i < 8; i++) {
+      xh = (xh << 8) | p[i];
+      xl = (xl << 8) | p[8 + i];
+    }
+    gfMultiply(yh ^ xh, yl ^ xl, hpow[0], hpow[1], &yh, &yl);
+    p += MAX_WIDTH;
+  }
+  scratch[2 * lid] = yh;
+  scratch[2 * lid + 1] = yl;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  int level = 1;
+  for (size_t s = 1; s < lsize; s <<= 1, level++) {
+    if ((lid & (2 * s - 1)) == 0) {
+      gfMultiply(scratch[2 * lid], scratch[2 * lid + 1], hpow[2 * level], hpow[2 * level + 1], &yh, &yl);
+      scratch[2 * lid] = yh ^ scratch[2 * (lid + s)];
+      scratch[2 * lid + 1] = yl ^ scratch[2 * (lid + s) + 1];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+  if (lid == 0) {
+    partial[2 * get_group_id(0)] = scratch[0];
+    partial[2 * get_group_id(0) + 1] = scratch[1];
+  }
+}
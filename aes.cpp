@@ -16,8 +16,6 @@
 #include <stdio.h>
 #include <string.h>
 #include "aes.h"
-// We use round number 10 for AES 128
-#define ROUND 10
 // The bytes of every message
 #define MAX_WIDTH 16
 #define xtime(x)   ((x<<1) ^ (((x>>7) & 1) * 0x1b))
@@ -43,7 +41,12 @@ unsigned char sbox[256] = {
 };
 
 // The Rcon Matrix
-unsigned char Rcon[ROUND + 1] = {0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36};
+unsigned char Rcon[11] = {0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36};
+
+// The engine used by encrypt() and decrypt()
+int engine = ENGINE_REFERENCE;
+// Nr for the key size in use, 10 for AES-128
+int rounds = 10;
 
 // The reverse Substitution Box
 unsigned char rsbox[256] = {
@@ -65,6 +68,83 @@ unsigned char rsbox[256] = {
     0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d 
 };
 
+// GF(2^8) multiplication tables for InvMixColumns
+unsigned char mul9[256] = {
+    0x00, 0x09, 0x12, 0x1b, 0x24, 0x2d, 0x36, 0x3f, 0x48, 0x41, 0x5a, 0x53, 0x6c, 0x65, 0x7e, 0x77,
+    0x90, 0x99, 0x82, 0x8b, 0xb4, 0xbd, 0xa6, 0xaf, 0xd8, 0xd1, 0xca, 0xc3, 0xfc, 0xf5, 0xee, 0xe7,
+    0x3b, 0x32, 0x29, 0x20, 0x1f, 0x16, 0x0d, 0x04, 0x73, 0x7a, 0x61, 0x68, 0x57, 0x5e, 0x45, 0x4c,
+    0xab, 0xa2, 0xb9, 0xb0, 0x8f, 0x86, 0x9d, 0x94, 0xe3, 0xea, 0xf1, 0xf8, 0xc7, 0xce, 0xd5, 0xdc,
+    0x76, 0x7f, 0x64, 0x6d, 0x52, 0x5b, 0x40, 0x49, 0x3e, 0x37, 0x2c, 0x25, 0x1a, 0x13, 0x08, 0x01,
+    0xe6, 0xef, 0xf4, 0xfd, 0xc2, 0xcb, 0xd0, 0xd9, 0xae, 0xa7, 0xbc, 0xb5, 0x8a, 0x83, 0x98, 0x91,
+    0x4d, 0x44, 0x5f, 0x56, 0x69, 0x60, 0x7b, 0x72, 0x05, 0x0c, 0x17, 0x1e, 0x21, 0x28, 0x33, 0x3a,
+    0xdd, 0xd4, 0xcf, 0xc6, 0xf9, 0xf0, 0xeb, 0xe2, 0x95, 0x9c, 0x87, 0x8e, 0xb1, 0xb8, 0xa3, 0xaa,
+    0xec, 0xe5, 0xfe, 0xf7, 0xc8, 0xc1, 0xda, 0xd3, 0xa4, 0xad, 0xb6, 0xbf, 0x80, 0x89, 0x92, 0x9b,
+    0x7c, 0x75, 0x6e, 0x67, 0x58, 0x51, 0x4a, 0x43, 0x34, 0x3d, 0x26, 0x2f, 0x10, 0x19, 0x02, 0x0b,
+    0xd7, 0xde, 0xc5, 0xcc, 0xf3, 0xfa, 0xe1, 0xe8, 0x9f, 0x96, 0x8d, 0x84, 0xbb, 0xb2, 0xa9, 0xa0,
+    0x47, 0x4e, 0x55, 0x5c, 0x63, 0x6a, 0x71, 0x78, 0x0f, 0x06, 0x1d, 0x14, 0x2b, 0x22, 0x39, 0x30,
+    0x9a, 0x93, 0x88, 0x81, 0xbe, 0xb7, 0xac, 0xa5, 0xd2, 0xdb, 0xc0, 0xc9, 0xf6, 0xff, 0xe4, 0xed,
+    0x0a, 0x03, 0x18, 0x11, 0x2e, 0x27, 0x3c, 0x35, 0x42, 0x4b, 0x50, 0x59, 0x66, 0x6f, 0x74, 0x7d,
+    0xa1, 0xa8, 0xb3, 0xba, 0x85, 0x8c, 0x97, 0x9e, 0xe9, 0xe0, 0xfb, 0xf2, 0xcd, 0xc4, 0xdf, 0xd6,
+    0x31, 0x38, 0x23, 0x2a, 0x15, 0x1c, 0x07, 0x0e, 0x79, 0x70, 0x6b, 0x62, 0x5d, 0x54, 0x4f, 0x46 
+};
+
+unsigned char mul11[256] = {
+    0x00, 0x0b, 0x16, 0x1d, 0x2c, 0x27, 0x3a, 0x31, 0x58, 0x53, 0x4e, 0x45, 0x74, 0x7f, 0x62, 0x69,
+    0xb0, 0xbb, 0xa6, 0xad, 0x9c, 0x97, 0x8a, 0x81, 0xe8, 0xe3, 0xfe, 0xf5, 0xc4, 0xcf, 0xd2, 0xd9,
+    0x7b, 0x70, 0x6d, 0x66, 0x57, 0x5c, 0x41, 0x4a, 0x23, 0x28, 0x35, 0x3e, 0x0f, 0x04, 0x19, 0x12,
+    0xcb, 0xc0, 0xdd, 0xd6, 0xe7, 0xec, 0xf1, 0xfa, 0x93, 0x98, 0x85, 0x8e, 0xbf, 0xb4, 0xa9, 0xa2,
+    0xf6, 0xfd, 0xe0, 0xeb, 0xda, 0xd1, 0xcc, 0xc7, 0xae, 0xa5, 0xb8, 0xb3, 0x82, 0x89, 0x94, 0x9f,
+    0x46, 0x4d, 0x50, 0x5b, 0x6a, 0x61, 0x7c, 0x77, 0x1e, 0x15, 0x08, 0x03, 0x32, 0x39, 0x24, 0x2f,
+    0x8d, 0x86, 0x9b, 0x90, 0xa1, 0xaa, 0xb7, 0xbc, 0xd5, 0xde, 0xc3, 0xc8, 0xf9, 0xf2, 0xef, 0xe4,
+    0x3d, 0x36, 0x2b, 0x20, 0x11, 0x1a, 0x07, 0x0c, 0x65, 0x6e, 0x73, 0x78, 0x49, 0x42, 0x5f, 0x54,
+    0xf7, 0xfc, 0xe1, 0xea, 0xdb, 0xd0, 0xcd, 0xc6, 0xaf, 0xa4, 0xb9, 0xb2, 0x83, 0x88, 0x95, 0x9e,
+    0x47, 0x4c, 0x51, 0x5a, 0x6b, 0x60, 0x7d, 0x76, 0x1f, 0x14, 0x09, 0x02, 0x33, 0x38, 0x25, 0x2e,
+    0x8c, 0x87, 0x9a, 0x91, 0xa0, 0xab, 0xb6, 0xbd, 0xd4, 0xdf, 0xc2, 0xc9, 0xf8, 0xf3, 0xee, 0xe5,
+    0x3c, 0x37, 0x2a, 0x21, 0x10, 0x1b, 0x06, 0x0d, 0x64, 0x6f, 0x72, 0x79, 0x48, 0x43, 0x5e, 0x55,
+    0x01, 0x0a, 0x17, 0x1c, 0x2d, 0x26, 0x3b, 0x30, 0x59, 0x52, 0x4f, 0x44, 0x75, 0x7e, 0x63, 0x68,
+    0xb1, 0xba, 0xa7, 0xac, 0x9d, 0x96, 0x8b, 0x80, 0xe9, 0xe2, 0xff, 0xf4, 0xc5, 0xce, 0xd3, 0xd8,
+    0x7a, 0x71, 0x6c, 0x67, 0x56, 0x5d, 0x40, 0x4b, 0x22, 0x29, 0x34, 0x3f, 0x0e, 0x05, 0x18, 0x13,
+    0xca, 0xc1, 0xdc, 0xd7, 0xe6, 0xed, 0xf0, 0xfb, 0x92, 0x99, 0x84, 0x8f, 0xbe, 0xb5, 0xa8, 0xa3 
+};
+
+unsigned char mul13[256] = {
+    0x00, 0x0d, 0x1a, 0x17, 0x34, 0x39, 0x2e, 0x23, 0x68, 0x65, 0x72, 0x7f, 0x5c, 0x51, 0x46, 0x4b,
+    0xd0, 0xdd, 0xca, 0xc7, 0xe4, 0xe9, 0xfe, 0xf3, 0xb8, 0xb5, 0xa2, 0xaf, 0x8c, 0x81, 0x96, 0x9b,
+    0xbb, 0xb6, 0xa1, 0xac, 0x8f, 0x82, 0x95, 0x98, 0xd3, 0xde, 0xc9, 0xc4, 0xe7, 0xea, 0xfd, 0xf0,
+    0x6b, 0x66, 0x71, 0x7c, 0x5f, 0x52, 0x45, 0x48, 0x03, 0x0e, 0x19, 0x14, 0x37, 0x3a, 0x2d, 0x20,
+    0x6d, 0x60, 0x77, 0x7a, 0x59, 0x54, 0x43, 0x4e, 0x05, 0x08, 0x1f, 0x12, 0x31, 0x3c, 0x2b, 0x26,
+    0xbd, 0xb0, 0xa7, 0xaa, 0x89, 0x84, 0x93, 0x9e, 0xd5, 0xd8, 0xcf, 0xc2, 0xe1, 0xec, 0xfb, 0xf6,
+    0xd6, 0xdb, 0xcc, 0xc1, 0xe2, 0xef, 0xf8, 0xf5, 0xbe, 0xb3, 0xa4, 0xa9, 0x8a, 0x87, 0x90, 0x9d,
+    0x06, 0x0b, 0x1c, 0x11, 0x32, 0x3f, 0x28, 0x25, 0x6e, 0x63, 0x74, 0x79, 0x5a, 0x57, 0x40, 0x4d,
+    0xda, 0xd7, 0xc0, 0xcd, 0xee, 0xe3, 0xf4, 0xf9, 0xb2, 0xbf, 0xa8, 0xa5, 0x86, 0x8b, 0x9c, 0x91,
+    0x0a, 0x07, 0x10, 0x1d, 0x3e, 0x33, 0x24, 0x29, 0x62, 0x6f, 0x78, 0x75, 0x56, 0x5b, 0x4c, 0x41,
+    0x61, 0x6c, 0x7b, 0x76, 0x55, 0x58, 0x4f, 0x42, 0x09, 0x04, 0x13, 0x1e, 0x3d, 0x30, 0x27, 0x2a,
+    0xb1, 0xbc, 0xab, 0xa6, 0x85, 0x88, 0x9f, 0x92, 0xd9, 0xd4, 0xc3, 0xce, 0xed, 0xe0, 0xf7, 0xfa,
+    0xb7, 0xba, 0xad, 0xa0, 0x83, 0x8e, 0x99, 0x94, 0xdf, 0xd2, 0xc5, 0xc8, 0xeb, 0xe6, 0xf1, 0xfc,
+    0x67, 0x6a, 0x7d, 0x70, 0x53, 0x5e, 0x49, 0x44, 0x0f, 0x02, 0x15, 0x18, 0x3b, 0x36, 0x21, 0x2c,
+    0x0c, 0x01, 0x16, 0x1b, 0x38, 0x35, 0x22, 0x2f, 0x64, 0x69, 0x7e, 0x73, 0x50, 0x5d, 0x4a, 0x47,
+    0xdc, 0xd1, 0xc6, 0xcb, 0xe8, 0xe5, 0xf2, 0xff, 0xb4, 0xb9, 0xae, 0xa3, 0x80, 0x8d, 0x9a, 0x97 
+};
+
+unsigned char mul14[256] = {
+    0x00, 0x0e, 0x1c, 0x12, 0x38, 0x36, 0x24, 0x2a, 0x70, 0x7e, 0x6c, 0x62, 0x48, 0x46, 0x54, 0x5a,
+    0xe0, 0xee, 0xfc, 0xf2, 0xd8, 0xd6, 0xc4, 0xca, 0x90, 0x9e, 0x8c, 0x82, 0xa8, 0xa6, 0xb4, 0xba,
+    0xdb, 0xd5, 0xc7, 0xc9, 0xe3, 0xed, 0xff, 0xf1, 0xab, 0xa5, 0xb7, 0xb9, 0x93, 0x9d, 0x8f, 0x81,
+    0x3b, 0x35, 0x27, 0x29, 0x03, 0x0d, 0x1f, 0x11, 0x4b, 0x45, 0x57, 0x59, 0x73, 0x7d, 0x6f, 0x61,
+    0xad, 0xa3, 0xb1, 0xbf, 0x95, 0x9b, 0x89, 0x87, 0xdd, 0xd3, 0xc1, 0xcf, 0xe5, 0xeb, 0xf9, 0xf7,
+    0x4d, 0x43, 0x51, 0x5f, 0x75, 0x7b, 0x69, 0x67, 0x3d, 0x33, 0x21, 0x2f, 0x05, 0x0b, 0x19, 0x17,
+    0x76, 0x78, 0x6a, 0x64, 0x4e, 0x40, 0x52, 0x5c, 0x06, 0x08, 0x1a, 0x14, 0x3e, 0x30, 0x22, 0x2c,
+    0x96, 0x98, 0x8a, 0x84, 0xae, 0xa0, 0xb2, 0xbc, 0xe6, 0xe8, 0xfa, 0xf4, 0xde, 0xd0, 0xc2, 0xcc,
+    0x41, 0x4f, 0x5d, 0x53, 0x79, 0x77, 0x65, 0x6b, 0x31, 0x3f, 0x2d, 0x23, 0x09, 0x07, 0x15, 0x1b,
+    0xa1, 0xaf, 0xbd, 0xb3, 0x99, 0x97, 0x85, 0x8b, 0xd1, 0xdf, 0xcd, 0xc3, 0xe9, 0xe7, 0xf5, 0xfb,
+    0x9a, 0x94, 0x86, 0x88, 0xa2, 0xac, 0xbe, 0xb0, 0xea, 0xe4, 0xf6, 0xf8, 0xd2, 0xdc, 0xce, 0xc0,
+    0x7a, 0x74, 0x66, 0x68, 0x42, 0x4c, 0x5e, 0x50, 0x0a, 0x04, 0x16, 0x18, 0x32, 0x3c, 0x2e, 0x20,
+    0xec, 0xe2, 0xf0, 0xfe, 0xd4, 0xda, 0xc8, 0xc6, 0x9c, 0x92, 0x80, 0x8e, 0xa4, 0xaa, 0xb8, 0xb6,
+    0x0c, 0x02, 0x10, 0x1e, 0x34, 0x3a, 0x28, 0x26, 0x7c, 0x72, 0x60, 0x6e, 0x44, 0x4a, 0x58, 0x56,
+    0x37, 0x39, 0x2b, 0x25, 0x0f, 0x01, 0x13, 0x1d, 0x47, 0x49, 0x5b, 0x55, 0x7f, 0x71, 0x63, 0x6d,
+    0xd7, 0xd9, 0xcb, 0xc5, 0xef, 0xe1, 0xf3, 0xfd, 0xa7, 0xa9, 0xbb, 0xb5, 0x9f, 0x91, 0x83, 0x8d 
+};
+
 /**
  * Key schedule helper function
  */
@@ -83,26 +163,33 @@ void keyExpansionCore (unsigned char* in, unsigned char i) {
 
 /**
  * The key schedule function
- * Expand the key into the size for round number
+ * Expand the key into the size for round number, the key is 16, 24 or 32
+ * bytes long as picked by setKeySize()
  */
 void keyExpansion (unsigned char* inputKey, unsigned char* expansionKeys) {
-    for(int i = 0; i < MAX_WIDTH; i++){
+    int keyBytes = 4 * (rounds - 6);
+    for(int i = 0; i < keyBytes; i++){
         expansionKeys[i] = inputKey[i];
     }
-    int byteG = MAX_WIDTH;
+    int byteG = keyBytes;
     int rcon = 1;
     unsigned char temp[4];
 
-    while (byteG < 176) {
+    while (byteG < MAX_WIDTH * (rounds + 1)) {
         for (int i = 0; i < 4; i++) {
             temp[i] = expansionKeys[i + byteG - 4];
         }
-        if (byteG % MAX_WIDTH == 0) {
+        if (byteG % keyBytes == 0) {
             keyExpansionCore(temp, rcon);
             rcon++;
+        } else if (keyBytes == 32 && byteG % keyBytes == MAX_WIDTH) {
+            // AES-256 adds a SubWord halfway through every key length
+            for (int i = 0; i < 4; i++) {
+                temp[i] = sbox[temp[i]];
+            }
         }
         for (unsigned char a = 0; a < 4; a++) {
-            expansionKeys[byteG] = expansionKeys[byteG - MAX_WIDTH] ^ temp[a];
+            expansionKeys[byteG] = expansionKeys[byteG - keyBytes] ^ temp[a];
             byteG++;
         }
     }
@@ -237,10 +324,10 @@ void invMixColumns (unsigned char* state) {
     c = state[4 * i + 2];
     d = state[4 * i + 3];
 
-    state[4 * i + 0] = multiply(a, 0x0e) ^ multiply(b, 0x0b) ^ multiply(c, 0x0d) ^ multiply(d, 0x09);
-    state[4 * i + 1] = multiply(a, 0x09) ^ multiply(b, 0x0e) ^ multiply(c, 0x0b) ^ multiply(d, 0x0d);
-    state[4 * i + 2] = multiply(a, 0x0d) ^ multiply(b, 0x09) ^ multiply(c, 0x0e) ^ multiply(d, 0x0b);
-    state[4 * i + 3] = multiply(a, 0x0b) ^ multiply(b, 0x0d) ^ multiply(c, 0x09) ^ multiply(d, 0x0e);
+    state[4 * i + 0] = mul14[a] ^ mul11[b] ^ mul13[c] ^ mul9[d];
+    state[4 * i + 1] = mul9[a] ^ mul14[b] ^ mul11[c] ^ mul13[d];
+    state[4 * i + 2] = mul13[a] ^ mul9[b] ^ mul14[c] ^ mul11[d];
+    state[4 * i + 3] = mul11[a] ^ mul13[b] ^ mul9[c] ^ mul14[d];
 
   }
 }
@@ -251,45 +338,396 @@ void addRoundKey (unsigned char* state, unsigned char* roundKey) {
     }
 }
 
-void encryption (unsigned char* state, unsigned char* key) {
-    // the final round does not include the mixColumns transformation
-    addRoundKey(state, key);
-    for (int i = 0; i < ROUND - 1; i++) {
+/**
+ * Rounds I to Nr of the reference cipher
+ * Each round calls the next through the template, so the compiler sees a
+ * straight line of Nr rounds and no loop over the round count is left.
+ * The decryption rounds count down: round I uses round key Nr - I.
+ */
+template <int I, int Nr> struct Rounds {
+    static inline void encryption (unsigned char* state, unsigned char* key) {
         subBytes(state);
         shiftRows(state);
         mixColumns(state);
-        addRoundKey(state, key + (MAX_WIDTH * (i + 1)));
+        addRoundKey(state, key + MAX_WIDTH * I);
+        Rounds<I + 1, Nr>::encryption(state, key);
     }
-    subBytes(state);
-    shiftRows(state); 
-    addRoundKey(state, key + MAX_WIDTH * ROUND);
-}
-
 
-void decryption (unsigned char* state, unsigned char* key) {
-    // the inverse order of encryption
-    // the final round does not include the mixColumns transformation
-    addRoundKey(state, key + MAX_WIDTH * ROUND);
-    for (int i = ROUND - 2; i >= 0; i--) {
+    static inline void decryption (unsigned char* state, unsigned char* key) {
         invShiftRows(state);
         invSubBytes(state);
-        addRoundKey(state, key + (MAX_WIDTH * (i + 1)));
+        addRoundKey(state, key + MAX_WIDTH * (Nr - I));
+        invMixColumns(state);
+        Rounds<I + 1, Nr>::decryption(state, key);
+    }
+
+    static inline void decryptionInv (unsigned char* state, unsigned char* decKey) {
+        invSubBytes(state);
+        invShiftRows(state);
         invMixColumns(state);
+        addRoundKey(state, decKey + MAX_WIDTH * (Nr - I));
+        Rounds<I + 1, Nr>::decryptionInv(state, decKey);
+    }
+};
+
+// the final round does not include the mixColumns transformation
+template <int Nr> struct Rounds<Nr, Nr> {
+    static inline void encryption (unsigned char* state, unsigned char* key) {
+        subBytes(state);
+        shiftRows(state);
+        addRoundKey(state, key + MAX_WIDTH * Nr);
+    }
+
+    static inline void decryption (unsigned char* state, unsigned char* key) {
+        invShiftRows(state);
+        invSubBytes(state);
+        addRoundKey(state, key);
+    }
+
+    static inline void decryptionInv (unsigned char* state, unsigned char* decKey) {
+        invSubBytes(state);
+        invShiftRows(state);
+        addRoundKey(state, decKey);
     }
-    invShiftRows(state);
-    invSubBytes(state);
+};
+
+template <int Nr> void encryption (unsigned char* state, unsigned char* key) {
     addRoundKey(state, key);
+    Rounds<1, Nr>::encryption(state, key);
+}
+
+template <int Nr> void decryption (unsigned char* state, unsigned char* key) {
+    // the inverse order of encryption
+    addRoundKey(state, key + MAX_WIDTH * Nr);
+    Rounds<1, Nr>::decryption(state, key);
+}
+
+/**
+ * The key schedule for the equivalent inverse cipher
+ * Same as keyExpansion() with InvMixColumns applied to the middle round keys,
+ * so decryption can add them right after its own InvMixColumns step
+ */
+void keyExpansionInv (unsigned char* inputKey, unsigned char* decKeys) {
+    keyExpansion(inputKey, decKeys);
+    for (int i = 1; i < rounds; i++) {
+        invMixColumns(decKeys + MAX_WIDTH * i);
+    }
+}
+
+/**
+ * The equivalent inverse cipher, key must come from keyExpansionInv()
+ * It has the same sequence of steps as encryption()
+ */
+template <int Nr> void decryptionInv (unsigned char* state, unsigned char* decKey) {
+    addRoundKey(state, decKey + MAX_WIDTH * Nr);
+    Rounds<1, Nr>::decryptionInv(state, decKey);
+}
+
+/**
+ * The T-table engine
+ * Each table entry packs the SubBytes and MixColumns result of one byte as a
+ * 32-bit column, so a whole round becomes 16 lookups and XORs on words.
+ * Columns are stored little-endian: row r of a column lives in bits 8r..8r+7.
+ */
+unsigned int Te0[256], Te1[256], Te2[256], Te3[256];
+unsigned int Td0[256], Td1[256], Td2[256], Td3[256];
+static bool tablesReady = false;
+
+#define ROTL8(x) (((x) << 8) | ((x) >> 24))
+#define GETWORD(p) ((unsigned int)(p)[0] | ((unsigned int)(p)[1] << 8) | \
+                    ((unsigned int)(p)[2] << 16) | ((unsigned int)(p)[3] << 24))
+#define PUTWORD(p, w) do { (p)[0] = (unsigned char)(w); (p)[1] = (unsigned char)((w) >> 8); \
+                           (p)[2] = (unsigned char)((w) >> 16); (p)[3] = (unsigned char)((w) >> 24); } while (0)
+#define B0(x) ((x) & 0xff)
+#define B1(x) (((x) >> 8) & 0xff)
+#define B2(x) (((x) >> 16) & 0xff)
+#define B3(x) ((x) >> 24)
+
+/**
+ * Build the encryption and decryption T-tables from the substitution boxes
+ */
+void initTables () {
+    if (tablesReady) {
+        return;
+    }
+    for (int i = 0; i < 256; i++) {
+        unsigned char s = sbox[i];
+        unsigned char r = rsbox[i];
+        // MixColumns column for row 0 is (2, 1, 1, 3)
+        unsigned int e = (unsigned int)multiply(s, 2) | ((unsigned int)s << 8) |
+                         ((unsigned int)s << 16) | ((unsigned int)multiply(s, 3) << 24);
+        // InvMixColumns column for row 0 is (e, 9, d, b)
+        unsigned int d = (unsigned int)multiply(r, 0x0e) | ((unsigned int)multiply(r, 0x09) << 8) |
+                         ((unsigned int)multiply(r, 0x0d) << 16) | ((unsigned int)multiply(r, 0x0b) << 24);
+        Te0[i] = e;
+        Te1[i] = ROTL8(Te0[i]);
+        Te2[i] = ROTL8(Te1[i]);
+        Te3[i] = ROTL8(Te2[i]);
+        Td0[i] = d;
+        Td1[i] = ROTL8(Td0[i]);
+        Td2[i] = ROTL8(Td1[i]);
+        Td3[i] = ROTL8(Td2[i]);
+    }
+    tablesReady = true;
+}
+
+/**
+ * The middle rounds I to Nr - 1 of the T-table cipher, unrolled like Rounds
+ */
+template <int I, int Nr> struct TableRounds {
+    static inline void encryption (unsigned int& s0, unsigned int& s1, unsigned int& s2, unsigned int& s3, unsigned char* key) {
+        unsigned char* rk = key + MAX_WIDTH * I;
+        unsigned int t0, t1, t2, t3;
+        t0 = Te0[B0(s0)] ^ Te1[B1(s1)] ^ Te2[B2(s2)] ^ Te3[B3(s3)] ^ GETWORD(rk);
+        t1 = Te0[B0(s1)] ^ Te1[B1(s2)] ^ Te2[B2(s3)] ^ Te3[B3(s0)] ^ GETWORD(rk + 4);
+        t2 = Te0[B0(s2)] ^ Te1[B1(s3)] ^ Te2[B2(s0)] ^ Te3[B3(s1)] ^ GETWORD(rk + 8);
+        t3 = Te0[B0(s3)] ^ Te1[B1(s0)] ^ Te2[B2(s1)] ^ Te3[B3(s2)] ^ GETWORD(rk + 12);
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+        TableRounds<I + 1, Nr>::encryption(s0, s1, s2, s3, key);
+    }
+
+    static inline void decryption (unsigned int& s0, unsigned int& s1, unsigned int& s2, unsigned int& s3, unsigned char* decKey) {
+        unsigned char* rk = decKey + MAX_WIDTH * (Nr - I);
+        unsigned int t0, t1, t2, t3;
+        t0 = Td0[B0(s0)] ^ Td1[B1(s3)] ^ Td2[B2(s2)] ^ Td3[B3(s1)] ^ GETWORD(rk);
+        t1 = Td0[B0(s1)] ^ Td1[B1(s0)] ^ Td2[B2(s3)] ^ Td3[B3(s2)] ^ GETWORD(rk + 4);
+        t2 = Td0[B0(s2)] ^ Td1[B1(s1)] ^ Td2[B2(s0)] ^ Td3[B3(s3)] ^ GETWORD(rk + 8);
+        t3 = Td0[B0(s3)] ^ Td1[B1(s2)] ^ Td2[B2(s1)] ^ Td3[B3(s0)] ^ GETWORD(rk + 12);
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+        TableRounds<I + 1, Nr>::decryption(s0, s1, s2, s3, decKey);
+    }
+};
+
+template <int Nr> struct TableRounds<Nr, Nr> {
+    static inline void encryption (unsigned int&, unsigned int&, unsigned int&, unsigned int&, unsigned char*) {
+    }
+
+    static inline void decryption (unsigned int&, unsigned int&, unsigned int&, unsigned int&, unsigned char*) {
+    }
+};
+
+template <int Nr> void ttableEncryption (unsigned char* state, unsigned char* key) {
+    unsigned int s0, s1, s2, s3, t0, t1, t2, t3;
+    s0 = GETWORD(state) ^ GETWORD(key);
+    s1 = GETWORD(state + 4) ^ GETWORD(key + 4);
+    s2 = GETWORD(state + 8) ^ GETWORD(key + 8);
+    s3 = GETWORD(state + 12) ^ GETWORD(key + 12);
+    TableRounds<1, Nr>::encryption(s0, s1, s2, s3, key);
+    // the final round does not include the mixColumns transformation
+    unsigned char* rk = key + MAX_WIDTH * Nr;
+    t0 = (unsigned int)sbox[B0(s0)] | ((unsigned int)sbox[B1(s1)] << 8) |
+         ((unsigned int)sbox[B2(s2)] << 16) | ((unsigned int)sbox[B3(s3)] << 24);
+    t1 = (unsigned int)sbox[B0(s1)] | ((unsigned int)sbox[B1(s2)] << 8) |
+         ((unsigned int)sbox[B2(s3)] << 16) | ((unsigned int)sbox[B3(s0)] << 24);
+    t2 = (unsigned int)sbox[B0(s2)] | ((unsigned int)sbox[B1(s3)] << 8) |
+         ((unsigned int)sbox[B2(s0)] << 16) | ((unsigned int)sbox[B3(s1)] << 24);
+    t3 = (unsigned int)sbox[B0(s3)] | ((unsigned int)sbox[B1(s0)] << 8) |
+         ((unsigned int)sbox[B2(s1)] << 16) | ((unsigned int)sbox[B3(s2)] << 24);
+    t0 ^= GETWORD(rk);
+    t1 ^= GETWORD(rk + 4);
+    t2 ^= GETWORD(rk + 8);
+    t3 ^= GETWORD(rk + 12);
+    PUTWORD(state, t0);
+    PUTWORD(state + 4, t1);
+    PUTWORD(state + 8, t2);
+    PUTWORD(state + 12, t3);
+}
+
+/**
+ * T-table decryption, key must come from keyExpansionInv()
+ */
+template <int Nr> void ttableDecryption (unsigned char* state, unsigned char* decKey) {
+    unsigned int s0, s1, s2, s3, t0, t1, t2, t3;
+    unsigned char* rk = decKey + MAX_WIDTH * Nr;
+    s0 = GETWORD(state) ^ GETWORD(rk);
+    s1 = GETWORD(state + 4) ^ GETWORD(rk + 4);
+    s2 = GETWORD(state + 8) ^ GETWORD(rk + 8);
+    s3 = GETWORD(state + 12) ^ GETWORD(rk + 12);
+    TableRounds<1, Nr>::decryption(s0, s1, s2, s3, decKey);
+    rk = decKey;
+    t0 = (unsigned int)rsbox[B0(s0)] | ((unsigned int)rsbox[B1(s3)] << 8) |
+         ((unsigned int)rsbox[B2(s2)] << 16) | ((unsigned int)rsbox[B3(s1)] << 24);
+    t1 = (unsigned int)rsbox[B0(s1)] | ((unsigned int)rsbox[B1(s0)] << 8) |
+         ((unsigned int)rsbox[B2(s3)] << 16) | ((unsigned int)rsbox[B3(s2)] << 24);
+    t2 = (unsigned int)rsbox[B0(s2)] | ((unsigned int)rsbox[B1(s1)] << 8) |
+         ((unsigned int)rsbox[B2(s0)] << 16) | ((unsigned int)rsbox[B3(s3)] << 24);
+    t3 = (unsigned int)rsbox[B0(s3)] | ((unsigned int)rsbox[B1(s2)] << 8) |
+         ((unsigned int)rsbox[B2(s1)] << 16) | ((unsigned int)rsbox[B3(s0)] << 24);
+    t0 ^= GETWORD(rk);
+    t1 ^= GETWORD(rk + 4);
+    t2 ^= GETWORD(rk + 8);
+    t3 ^= GETWORD(rk + 12);
+    PUTWORD(state, t0);
+    PUTWORD(state + 4, t1);
+    PUTWORD(state + 8, t2);
+    PUTWORD(state + 12, t3);
+}
+
+/**
+ * Pick the engine used by encrypt() and decrypt()
+ * Returns 0 on success and -1 for an unknown engine name
+ */
+int setEngine (const char* name) {
+    if (strcmp(name, "auto") == 0) {
+        // prefer the hardware instructions when CPUID reports them
+        return setEngine(aesniSupported() ? "aesni" : "reference");
+    } else if (strcmp(name, "reference") == 0) {
+        engine = ENGINE_REFERENCE;
+    } else if (strcmp(name, "ttable") == 0) {
+        initTables();
+        engine = ENGINE_TTABLE;
+    } else if (strcmp(name, "aesni") == 0 && aesniSupported()) {
+        engine = ENGINE_AESNI;
+    } else if (strcmp(name, "bitslice") == 0) {
+        engine = ENGINE_BITSLICE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Pick the key size used by keyExpansion(), encrypt() and decrypt()
+ * Returns 0 on success and -1 for a size other than 128, 192 or 256 bits
+ */
+int setKeySize (int bits) {
+    if (bits != 128 && bits != 192 && bits != 256) {
+        return -1;
+    }
+    rounds = bits / 32 + 6;
+    return 0;
+}
+
+template <int Nr> static void encryptLines (int lines, unsigned char* state, unsigned char* key) {
+    switch (engine) {
+        case ENGINE_TTABLE:
+            for (int i = 0; i < lines; i++) {
+                ttableEncryption<Nr>(state + i * MAX_WIDTH, key);
+            }
+            break;
+        case ENGINE_AESNI:
+            aesniEncrypt(lines, state, key);
+            break;
+        case ENGINE_BITSLICE:
+            bitsliceEncrypt(lines, state, key);
+            break;
+        default:
+            for (int i = 0; i < lines; i++) {
+                encryption<Nr>(state + i * MAX_WIDTH, key);
+            }
+            break;
+    }
+}
+
+template <int Nr> static void decryptLines (int lines, unsigned char* state, unsigned char* decKey) {
+    switch (engine) {
+        case ENGINE_TTABLE:
+            for (int i = 0; i < lines; i++) {
+                ttableDecryption<Nr>(state + i * MAX_WIDTH, decKey);
+            }
+            break;
+        case ENGINE_AESNI:
+            aesniDecrypt(lines, state, decKey);
+            break;
+        case ENGINE_BITSLICE:
+            bitsliceDecrypt(lines, state, decKey);
+            break;
+        default:
+            for (int i = 0; i < lines; i++) {
+                decryptionInv<Nr>(state + i * MAX_WIDTH, decKey);
+            }
+            break;
+    }
 }
 
+/**
+ * The round count is resolved once per call, every line then runs a fully
+ * unrolled instance for that key size
+ */
 void encrypt (int lines, unsigned char* state, unsigned char* key) {
-    for (int i = 0; i < lines; i++) {
-        encryption(state + i * MAX_WIDTH, key);
+    switch (rounds) {
+        case 12:
+            encryptLines<12>(lines, state, key);
+            break;
+        case 14:
+            encryptLines<14>(lines, state, key);
+            break;
+        default:
+            encryptLines<10>(lines, state, key);
+            break;
+    }
+}
+
+/**
+ * Decrypt with a schedule from keyExpansionInv(), the cheap path when the
+ * same key is reused
+ */
+void decryptInv (int lines, unsigned char* state, unsigned char* decKey) {
+    switch (rounds) {
+        case 12:
+            decryptLines<12>(lines, state, decKey);
+            break;
+        case 14:
+            decryptLines<14>(lines, state, decKey);
+            break;
+        default:
+            decryptLines<10>(lines, state, decKey);
+            break;
     }
 }
 
 void decrypt (int lines, unsigned char* state, unsigned char* key) {
-    for (int i = 0; i < lines; i++) {
-        decryption(state + i * MAX_WIDTH, key);
+    unsigned char decKey[MAX_KEY_SCHEDULE];
+    memcpy(decKey, key, MAX_WIDTH * (rounds + 1));
+    for (int i = 1; i < rounds; i++) {
+        invMixColumns(decKey + MAX_WIDTH * i);
+    }
+    decryptInv(lines, state, decKey);
+}
+
+// "make bench" links the main() of bench.cpp instead
+#ifndef AES_BENCH
+// the keys of a streamed run of main()
+struct StreamJob {
+    int mode;
+    unsigned char* key;
+    unsigned char* decKey;
+    unsigned char* iv;
+};
+
+/**
+ * One window of a streamed run, in the modes of main() that can work a
+ * window at a time. CBC carries the iv from one window to the next.
+ */
+static int streamWindow (void* ctx, unsigned char* data, int lines, unsigned long long line) {
+    StreamJob* job = (StreamJob*)ctx;
+    switch (job->mode) {
+        case 0:
+            parallelEncrypt(lines, data, job->key);
+            return 0;
+        case 1:
+            parallelDecrypt(lines, data, job->decKey);
+            return 0;
+        case 2:
+            return encryption_fpga(lines, data, job->key);
+        case 4:
+            parallelCtr(lines, data, job->key, job->iv, line);
+            return 0;
+        case 5:
+            return ctr_fpga(lines, data, job->key, job->iv, line);
+        case 7:
+            cbcEncrypt(lines, data, job->key, job->iv);
+            return 0;
+        case 8:
+            parallelCbcDecrypt(lines, data, job->decKey, job->iv);
+            return 0;
+        case 9:
+            return cbc_decrypt_fpga(lines, data, job->key, job->iv);
+        case 10:
+            hybridEncrypt(lines, data, job->key);
+            return 0;
+        default:
+            return decryption_fpga(lines, data, job->key);
     }
 }
 
@@ -297,36 +735,145 @@ int main (int argc, char *argv[]) {
     FILE *fp;
     int mode = 0;
     int numberOfLines;
-    int size;
+    size_t size;
     int num_bytes_read;
     unsigned char *message;
-    if (argc != 4)
+    const char *outName = NULL;
+    const char *io = "auto";
+    int depth = 0;
+    int opt;
+    setEngine("auto");
+    int threads = 1;
+    while ((opt = getopt(argc, argv, "e:t:k:c:f:o:i:q:")) != -1) {
+        switch (opt) {
+            case 'e':
+                if (setEngine(optarg) != 0) {
+                    fprintf(stderr,"Unknown engine %s\n",optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'k':
+                if (setKeySize(atoi(optarg)) != 0) {
+                    fprintf(stderr,"Key size must be 128, 192 or 256\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                fpga_chunk_lines(atoi(optarg));
+                break;
+            case 'f':
+                if (fpga_set_variant(optarg) != 0) {
+                    fprintf(stderr,"Unknown fpga kernel %s\n",optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'o':
+                outName = optarg;
+                break;
+            case 'i':
+                io = optarg;
+                break;
+            case 'q':
+                depth = atoi(optarg);
+                break;
+            default:
+                argc = 0;
+                break;
+        }
+    }
+    if (argc - optind != 2 && argc - optind != 3)
     {
-        fprintf(stderr,"Usage: %s input_file number_of_lines mode\n",argv[0]);        
+        fprintf(stderr,"Usage: %s [-e auto|reference|ttable|aesni|bitslice] [-t threads] [-k 128|192|256] [-c fpga_chunk_lines] [-f ndrange|pipe|wide4|wide8|wide16|local] [-o output_file] [-i auto|mmap|ring|uring] [-q uring_depth] input_file [number_of_lines] mode(0-10)\n",argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    // without a line count the whole file is used
+    numberOfLines = argc - optind == 3 ? atoi(argv[optind + 1]) : 0;
+    mode = atoi(argv[argc - 1]);
+
+    // only the first 16, 24 or 32 bytes are used, depending on the key size
+    unsigned char key[32] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
+                             17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32};
+    // the schedules start on a cache line like every other buffer
+    unsigned char expandedKey[MAX_KEY_SCHEDULE] __attribute__((aligned(64)));
+    unsigned char decryptionKey[MAX_KEY_SCHEDULE] __attribute__((aligned(64)));
+    unsigned char iv[MAX_WIDTH] = {0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+                                   0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff};
+    unsigned char tag[MAX_WIDTH];
+    // both schedules in one lookup, a key seen before is not expanded again
+    keyCacheStart(KEY_CACHE_ENTRIES);
+    cachedKeyExpansion(key, expandedKey, decryptionKey);
+    poolStart(threads);
+
+    // with an output file the input streams through in windows, binary
+    // output and memory bounded whatever the size of the file
+    if (outName != NULL) {
+        if (mode == 6) {
+            fprintf(stderr,"GCM needs the whole message, run it without -o\n");
+            exit(EXIT_FAILURE);
+        }
+        if (setStreamIo(io, depth) != 0) {
+            fprintf(stderr,"Unknown I/O path %s\n",io);
+            exit(EXIT_FAILURE);
+        }
+        // the data may be going to stdout, the session then reports on stderr
+        if (strcmp(outName, "-") == 0) {
+            fpga_set_log(stderr);
+        }
+        StreamJob job = {mode, expandedKey, decryptionKey, iv};
+        long long written = streamFile(argv[optind], outName, (unsigned long long)numberOfLines * 16, streamWindow, &job);
+        if (written < 0) {
+            fprintf(stderr,"Cannot stream %s to %s\n",argv[optind],outName);
+            exit(EXIT_FAILURE);
+        }
+        fprintf(strcmp(outName, "-") == 0 ? stderr : stdout, "%lld bytes written to %s\n", written, outName);
+        fpga_close();
+        poolStop();
+        keyCacheStop();
+        return 0;
     }
-    numberOfLines = atoi(argv[2]);
-    mode = atoi(argv[3]);
-    fp = fopen(argv[1],"r");
+
+    fp = fopen(argv[optind],"r");
     if (fp == NULL) {
-        fprintf(stderr,"Cannot open %s\n",argv[1]);
+        fprintf(stderr,"Cannot open %s\n",argv[optind]);
         exit(EXIT_FAILURE);
     }
-    size = numberOfLines * sizeof(unsigned char) * 16;
-    message = (unsigned char*)malloc(size);
-    num_bytes_read = fread(message,sizeof(unsigned char),numberOfLines * 16,fp);
+    if (numberOfLines <= 0) {
+        fseek(fp, 0, SEEK_END);
+        numberOfLines = (ftell(fp) + 15) / 16;
+        rewind(fp);
+    }
+    size = (size_t)numberOfLines * sizeof(unsigned char) * 16;
+    // the fpga modes work in place in memory the device can see
+    message = NULL;
+    if (mode == 2 || mode == 3 || mode == 5) {
+        message = fpga_alloc(size);
+    }
+    bool mapped = message != NULL;
+    if (message == NULL) {
+        message = arenaAlloc(size);
+    }
+    if (message == NULL) {
+        fprintf(stderr,"Cannot allocate %zu bytes\n",size);
+        exit(EXIT_FAILURE);
+    }
+    // a short last line is padded with zeros
+    if (size > 0) {
+        memset(message + size - MAX_WIDTH, 0, MAX_WIDTH);
+    }
+    num_bytes_read = fread(message,sizeof(unsigned char),size,fp);
     fclose(fp);
 
-    unsigned char key[MAX_WIDTH] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
-    unsigned char expandedKey[MAX_WIDTH * (ROUND + 1)];
-    keyExpansion(key, expandedKey);
     switch(mode){
         case 0:
-            encrypt(numberOfLines, message, expandedKey);
+            parallelEncrypt(numberOfLines, message, expandedKey);
             printf("Encryption: \n");
             printf("%s\n", message);
             break;
         case 1:
-            decrypt(numberOfLines, message, expandedKey);
+            parallelDecrypt(numberOfLines, message, decryptionKey);
             printf("Decryption: \n");
             printf("%s\n", message);
             break;
@@ -338,10 +885,66 @@ int main (int argc, char *argv[]) {
                 printf("%02x ", message[i]);
             }
             break;
+        case 4:
+            parallelCtr(numberOfLines, message, expandedKey, iv, 0);
+            printf("CTR: \n");
+            printf("%s\n", message);
+            break;
+        case 5:
+            printf("FPGA CTR: \n");
+            ctr_fpga(numberOfLines, message, expandedKey, iv, 0);
+            for (int i = 0; i < MAX_WIDTH; i++) {
+                printf("%02x ", message[i]);
+            }
+            break;
+        case 6:
+            gcmEncrypt(message, size, NULL, 0, expandedKey, iv, tag);
+            printf("GCM: \n");
+            printf("%s\n", message);
+            for (int i = 0; i < MAX_WIDTH; i++) {
+                printf("%02x ", tag[i]);
+            }
+            printf("\n");
+            break;
+        case 7:
+            cbcEncrypt(numberOfLines, message, expandedKey, iv);
+            printf("CBC Encryption: \n");
+            printf("%s\n", message);
+            break;
+        case 8:
+            parallelCbcDecrypt(numberOfLines, message, decryptionKey, iv);
+            printf("CBC Decryption: \n");
+            printf("%s\n", message);
+            break;
+        case 9:
+            printf("FPGA CBC Decryption: \n");
+            cbc_decrypt_fpga(numberOfLines, message, expandedKey, iv);
+            for (int i = 0; i < MAX_WIDTH; i++) {
+                printf("%02x ", message[i]);
+            }
+            break;
+        case 10:
+            printf("Hybrid Encryption: \n");
+            printf("%d of %d lines on the FPGA\n", hybridEncrypt(numberOfLines, message, expandedKey), numberOfLines);
+            for (int i = 0; i < MAX_WIDTH; i++) {
+                printf("%02x ", message[i]);
+            }
+            break;
         default:
             decryption_fpga(numberOfLines, message, expandedKey);
             printf("\nFPGA Decryption: \n");
             break;
     }
+    // setup is paid once per session, the call time is per request
+    if (fpga_setup_time() > 0) {
+        printf("\nFPGA setup: %.3f ms, request: %.3f ms\n", fpga_setup_time() * 1e3, fpga_call_time() * 1e3);
+    }
+    if (!mapped) {
+        arenaFree(message, size);
+    }
+    fpga_close();
+    poolStop();
+    keyCacheStop();
     return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
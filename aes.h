@@ -9,7 +9,141 @@
 #include <ctime>
 #include <string>
 #include <cstring>
+// One message of a batch: lines lines from line offset under schedule key
+// of the key table
+struct BatchEntry {
+	int key;
+	int offset;
+	int lines;
+};
+
 extern "C" {
+	// accelerator session, opened by the first *_fpga() call (fpga_aes.cpp)
+	int fpga_open();
+	void fpga_close();
+	double fpga_setup_time();
+	double fpga_call_time();
+	double fpga_transfer_time();
+	double fpga_kernel_time();
+	int fpga_set_variant(const char *name);
+	int fpga_chunk_lines(int num_of_lines);
+	void fpga_set_log(FILE *log);
+	unsigned char *fpga_alloc(size_t bytes);
+	void fpga_free(unsigned char *ptr);
 	int encryption_fpga(int num_of_lines, unsigned char *data, unsigned char *k);
 	int decryption_fpga(int num_of_lines, unsigned char *data, unsigned char *k);
-}
\ No newline at end of file
+	int ctr_fpga(int num_of_lines, unsigned char *data, unsigned char *k, const unsigned char *iv, unsigned long long block);
+	int ghash_fpga(int num_of_lines, const unsigned char *data, const unsigned char *h, unsigned char *y);
+	int cbc_decrypt_fpga(int num_of_lines, unsigned char *data, unsigned char *k, unsigned char *iv);
+	int xts_encrypt_fpga(unsigned char *data, size_t len, int unit, unsigned char *k1, unsigned char *k2, unsigned long long unit0);
+	int xts_decrypt_fpga(unsigned char *data, size_t len, int unit, unsigned char *k1, unsigned char *k2, unsigned long long unit0);
+	// batches, keys holds num_keys keyExpansion() schedules MAX_KEY_SCHEDULE
+	// bytes apart for both directions: unlike batchDecrypt(), decryption
+	// takes the encryption schedules, not keyExpansionInv() ones
+	int batch_encrypt_fpga(int count, const BatchEntry *entries, unsigned char *data, int num_keys, unsigned char *keys);
+	int batch_decrypt_fpga(int count, const BatchEntry *entries, unsigned char *data, int num_keys, unsigned char *keys);
+}
+
+// The CPU engines behind encrypt() and decrypt()
+enum {
+	ENGINE_REFERENCE = 0,
+	ENGINE_TTABLE,
+	ENGINE_AESNI,
+	ENGINE_BITSLICE
+};
+extern int engine;
+int setEngine(const char *name);
+
+// AES-128/192/256 run 10/12/14 rounds, picked with setKeySize()
+#define MAX_ROUND 14
+// bytes of the largest expanded key, enough for every key size
+#define MAX_KEY_SCHEDULE (16 * (MAX_ROUND + 1))
+extern int rounds;
+int setKeySize(int bits);
+void keyExpansion(unsigned char *inputKey, unsigned char *expansionKeys);
+void keyExpansionInv(unsigned char *inputKey, unsigned char *decKeys);
+void encrypt(int lines, unsigned char *state, unsigned char *key);
+void decrypt(int lines, unsigned char *state, unsigned char *key);
+void decryptInv(int lines, unsigned char *state, unsigned char *decKey);
+
+// AES-NI backend (aes_ni.cpp)
+int aesniSupported();
+void aesniEncrypt(int lines, unsigned char *state, unsigned char *key);
+void aesniDecrypt(int lines, unsigned char *state, unsigned char *decKey);
+// one line per lane, up to 8 lanes, each with its own schedule
+void aesniEncryptLanes(int lanes, unsigned char **lines, unsigned char **keys);
+void aesniDecryptLanes(int lanes, unsigned char **lines, unsigned char **decKeys);
+
+// Bitsliced constant-time engine, 8 lines per batch (aes_bitslice.cpp)
+void bitsliceEncrypt(int lines, unsigned char *state, unsigned char *key);
+void bitsliceDecrypt(int lines, unsigned char *state, unsigned char *decKey);
+void bitsliceEncryptLanes(int lanes, unsigned char **lines, unsigned char **keys);
+void bitsliceDecryptLanes(int lanes, unsigned char **lines, unsigned char **decKeys);
+
+// Cache-line aligned buffers recycled across jobs, arenaFree() takes the
+// size that was asked for (aes_arena.cpp)
+unsigned char *arenaAlloc(size_t bytes);
+void arenaFree(void *ptr, size_t bytes);
+void arenaRelease();
+
+// Persistent worker pool (aes_pool.cpp)
+int poolStart(int workers);
+void poolStop();
+int poolWorkers();
+void poolFor(int count, int grain, void (*body)(void *ctx, int begin, int end), void *ctx);
+void parallelEncrypt(int lines, unsigned char *state, unsigned char *key);
+void parallelDecrypt(int lines, unsigned char *state, unsigned char *decKey);
+
+// CTR mode, counter block i is iv + i as a 128-bit big-endian number (aes_modes.cpp)
+void ctrCounter(const unsigned char *iv, unsigned long long block, unsigned char *counter);
+void ctrXcrypt(int lines, unsigned char *data, unsigned char *key, const unsigned char *iv, unsigned long long block);
+void parallelCtr(int lines, unsigned char *data, unsigned char *key, const unsigned char *iv, unsigned long long block);
+
+// CBC mode, iv is updated to the last ciphertext line (aes_modes.cpp)
+void cbcEncrypt(int lines, unsigned char *data, unsigned char *key, unsigned char *iv);
+void cbcEncryptStreams(int streams, const int *lines, unsigned char **data, unsigned char *key, unsigned char **iv);
+void cbcDecrypt(int lines, unsigned char *data, unsigned char *decKey, unsigned char *iv);
+void parallelCbcDecrypt(int lines, unsigned char *data, unsigned char *decKey, unsigned char *iv);
+
+// XTS mode over data units of unit bytes (aes_modes.cpp)
+int xtsEncrypt(unsigned char *data, size_t len, int unit, unsigned char *key, unsigned char *tweakKey, unsigned long long unit0);
+int xtsDecrypt(unsigned char *data, size_t len, int unit, unsigned char *decKey, unsigned char *tweakKey, unsigned long long unit0);
+
+// Expanded-key cache keyed by the raw key and the key size, lookups take
+// no locks (aes_keycache.cpp)
+#define KEY_CACHE_ENTRIES 1024
+int keyCacheStart(int entries);
+void keyCacheStop();
+int cachedKeyExpansion(const unsigned char *inputKey, unsigned char *expansionKeys, unsigned char *decKeys);
+
+// Batches of messages with their own keys, keys holds keyExpansion()
+// schedules MAX_KEY_SCHEDULE bytes apart, keyExpansionInv() ones for
+// batchDecrypt(). batchKeys() builds both tables from raw keys through the
+// expanded-key cache (aes_batch.cpp)
+void batchKeys(int numKeys, const unsigned char *rawKeys, unsigned char *keys, unsigned char *decKeys);
+void batchEncrypt(int count, const BatchEntry *entries, unsigned char *data, unsigned char *keys);
+void batchDecrypt(int count, const BatchEntry *entries, unsigned char *data, unsigned char *decKeys);
+
+// CPU + accelerator co-scheduling, return the lines the accelerator did (aes_hybrid.cpp)
+int hybridEncrypt(int lines, unsigned char *data, unsigned char *key);
+int hybridDecrypt(int lines, unsigned char *data, unsigned char *key, unsigned char *decKey);
+int hybridCtr(int lines, unsigned char *data, unsigned char *key, const unsigned char *iv, unsigned long long block);
+
+// File to file a window at a time, body transforms lines in place and
+// returns 0 on success, line is the index of the first one (aes_io.cpp)
+typedef int (*StreamBody)(void *ctx, unsigned char *data, int lines, unsigned long long line);
+long long streamFile(const char *inName, const char *outName, unsigned long long limit, StreamBody body, void *ctx);
+int setStreamIo(const char *name, int depth);
+// returned by an I/O path that cannot handle the files, before it did anything
+#define STREAM_UNSUPPORTED -2
+
+// io_uring path of streamFile() with depth reads in flight (aes_uring.cpp)
+long long uringStream(int in, int out, unsigned long long size, int depth, StreamBody body, void *ctx);
+
+// AES-GCM with a 12-byte iv and 16-byte tag (aes_gcm.cpp)
+void gfMultiply(const unsigned char *x, const unsigned char *y, unsigned char *z);
+void ghash(const unsigned char *h, const unsigned char *data, int lines, unsigned char *y);
+void gcmEncrypt(unsigned char *data, size_t len, const unsigned char *aad, size_t aadLen,
+                unsigned char *key, const unsigned char *iv, unsigned char *tag);
+int gcmDecrypt(unsigned char *data, size_t len, const unsigned char *aad, size_t aadLen,
+               unsigned char *key, const unsigned char *iv, const unsigned char *tag);
@@ -0,0 +1,157 @@
+/**
+ *  Arena of aligned buffers
+ *  Message buffers, stream windows and key tables come from here instead
+ *  of malloc(), so a run of jobs reuses the same memory and its pages stay
+ *  mapped. Sizes below ARENA_HUGE are rounded up to a power of two and a
+ *  freed block goes on the free list of its size, where the next request
+ *  of that size picks it up without a system call. Larger sizes are only
+ *  rounded up to whole huge pages, doubling a message buffer would cost
+ *  as much memory as the message, and share one list of exact sizes.
+ *  Every block starts on a cache line, which is also the alignment the
+ *  OpenCL DMA engine wants for host memory. Blocks of a page or more
+ *  start on a page and blocks from ARENA_HUGE up are mapped with huge
+ *  pages where the kernel has them.
+ */
+#include <pthread.h>
+#include <sys/mman.h>
+#include "aes.h"
+
+#define CACHE_LINE 64
+#define ARENA_PAGE 4096
+#define ARENA_HUGE_CLASS 21
+#define ARENA_HUGE ((size_t)1 << ARENA_HUGE_CLASS)
+// the powers of two below ARENA_HUGE and a last class for all larger blocks
+#define ARENA_CLASSES (ARENA_HUGE_CLASS + 1)
+// free blocks kept per size and in all, the rest go back to the system
+#define ARENA_KEEP 16
+#define ARENA_LIMIT (1ULL << 27)
+
+struct FreeBlock {
+    FreeBlock* next;
+    size_t bytes;
+};
+
+static FreeBlock* freeLists[ARENA_CLASSES];
+static int freeCount[ARENA_CLASSES];
+static unsigned long long freeBytes = 0;
+static pthread_mutex_t arenaLock = PTHREAD_MUTEX_INITIALIZER;
+
+// The size class of bytes, blocks of a class below the last hold 2^c bytes
+static int sizeClass (size_t bytes) {
+    int c = 6;
+    while (c < ARENA_HUGE_CLASS && ((size_t)1 << c) < bytes) {
+        c++;
+    }
+    return c;
+}
+
+// The bytes of the block that holds bytes, 0 when no block can
+static size_t blockBytes (size_t bytes) {
+    int c = sizeClass(bytes);
+    if (c < ARENA_HUGE_CLASS) {
+        return (size_t)1 << c;
+    }
+    if (bytes > (size_t)-1 - ARENA_HUGE) {
+        return 0;
+    }
+    return (bytes + ARENA_HUGE - 1) & ~(ARENA_HUGE - 1);
+}
+
+static void* systemAlloc (size_t bytes) {
+    if (bytes >= ARENA_HUGE) {
+        // reserved huge pages first, else transparent ones
+        void* p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED) {
+            p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                return NULL;
+            }
+            madvise(p, bytes, MADV_HUGEPAGE);
+        }
+        return p;
+    }
+    void* p = NULL;
+    if (posix_memalign(&p, bytes >= ARENA_PAGE ? ARENA_PAGE : CACHE_LINE, bytes) != 0) {
+        return NULL;
+    }
+    return p;
+}
+
+static void systemFree (void* p, size_t bytes) {
+    if (bytes >= ARENA_HUGE) {
+        munmap(p, bytes);
+    } else {
+        free(p);
+    }
+}
+
+/**
+ * A block of at least bytes, aligned as described above. The contents are
+ * undefined, a recycled block holds what its last user left.
+ * Returns NULL when the system is out of memory
+ */
+unsigned char* arenaAlloc (size_t bytes) {
+    size_t size = blockBytes(bytes);
+    if (size == 0) {
+        return NULL;
+    }
+    int c = sizeClass(bytes);
+    pthread_mutex_lock(&arenaLock);
+    // the huge list mixes sizes, the other lists match on the first block
+    FreeBlock** link = &freeLists[c];
+    while (*link != NULL && (*link)->bytes != size) {
+        link = &(*link)->next;
+    }
+    FreeBlock* block = *link;
+    if (block != NULL) {
+        *link = block->next;
+        freeCount[c]--;
+        freeBytes -= size;
+    }
+    pthread_mutex_unlock(&arenaLock);
+    if (block != NULL) {
+        return (unsigned char*)block;
+    }
+    return (unsigned char*)systemAlloc(size);
+}
+
+/**
+ * Returns a block from arenaAlloc() for reuse, bytes is the size it was
+ * asked for. NULL is ignored
+ */
+void arenaFree (void* ptr, size_t bytes) {
+    if (ptr == NULL) {
+        return;
+    }
+    size_t size = blockBytes(bytes);
+    int c = sizeClass(bytes);
+    pthread_mutex_lock(&arenaLock);
+    bool keep = freeCount[c] < ARENA_KEEP && freeBytes + size <= ARENA_LIMIT;
+    if (keep) {
+        FreeBlock* block = (FreeBlock*)ptr;
+        block->next = freeLists[c];
+        block->bytes = size;
+        freeLists[c] = block;
+        freeCount[c]++;
+        freeBytes += size;
+    }
+    pthread_mutex_unlock(&arenaLock);
+    if (!keep) {
+        systemFree(ptr, size);
+    }
+}
+
+// Hands every free block back to the system, blocks in use stay valid
+void arenaRelease () {
+    pthread_mutex_lock(&arenaLock);
+    for (int c = 0; c < ARENA_CLASSES; c++) {
+        while (freeLists[c] != NULL) {
+            FreeBlock* block = freeLists[c];
+            freeLists[c] = block->next;
+            systemFree(block, block->bytes);
+        }
+        freeCount[c] = 0;
+    }
+    freeBytes = 0;
+    pthread_mutex_unlock(&arenaLock);
+}
@@ -0,0 +1,112 @@
+/**
+ *  Batches of independent messages, each with its own key
+ *  A batch is a table of expanded keys and descriptors (key, offset,
+ *  lines) into one buffer, and it runs as one call: the pool hands out
+ *  runs of descriptors, so a small message costs a table lookup rather
+ *  than a call of its own. Messages must not overlap.
+ *  With the bitsliced engine, the lines of messages of up to four lines
+ *  are gathered across descriptors into lanes of eight, each lane with its
+ *  own round keys, so they fill both slices instead of padding a batch
+ *  each. AES-NI gathers one-line messages the same way.
+ */
+#include "aes.h"
+
+#define MAX_WIDTH 16
+// descriptors per piece of the pool
+#define BATCH_GRAIN 64
+// lines per gathered pass
+#define BATCH_LANES 8
+// messages shorter than this are gathered: the bitsliced engine pads a
+// batch and slices the keys per call, which longer messages amortize, and
+// AES-NI already overlaps the separate calls of short messages out of
+// order, so only one-line messages gain there
+#define BITSLICE_GATHER 5
+#define AESNI_GATHER 2
+
+struct BatchJob {
+    const BatchEntry* entries;
+    unsigned char* data;
+    unsigned char* keys;
+    bool decrypt;
+};
+
+static void runLanes (BatchJob* job, int lanes, unsigned char** lines, unsigned char** keys) {
+    if (engine == ENGINE_AESNI) {
+        if (job->decrypt) {
+            aesniDecryptLanes(lanes, lines, keys);
+        } else {
+            aesniEncryptLanes(lanes, lines, keys);
+        }
+    } else if (job->decrypt) {
+        bitsliceDecryptLanes(lanes, lines, keys);
+    } else {
+        bitsliceEncryptLanes(lanes, lines, keys);
+    }
+}
+
+static void batchBody (void* ctx, int begin, int end) {
+    BatchJob* job = (BatchJob*)ctx;
+    int gather = engine == ENGINE_AESNI ? AESNI_GATHER : engine == ENGINE_BITSLICE ? BITSLICE_GATHER : 0;
+    unsigned char* lines[BATCH_LANES];
+    unsigned char* keys[BATCH_LANES];
+    int lanes = 0;
+    for (int i = begin; i < end; i++) {
+        const BatchEntry* e = &job->entries[i];
+        unsigned char* p = job->data + (size_t)e->offset * MAX_WIDTH;
+        unsigned char* k = job->keys + (size_t)e->key * MAX_KEY_SCHEDULE;
+        if (e->lines < gather) {
+            for (int l = 0; l < e->lines; l++) {
+                lines[lanes] = p + l * MAX_WIDTH;
+                keys[lanes] = k;
+                if (++lanes == BATCH_LANES) {
+                    runLanes(job, lanes, lines, keys);
+                    lanes = 0;
+                }
+            }
+        } else if (job->decrypt) {
+            decryptInv(e->lines, p, k);
+        } else {
+            encrypt(e->lines, p, k);
+        }
+    }
+    if (lanes > 0) {
+        runLanes(job, lanes, lines, keys);
+    }
+}
+
+struct KeyTableJob {
+    const unsigned char* rawKeys;
+    unsigned char* keys;
+    unsigned char* decKeys;
+};
+
+static void keyTableBody (void* ctx, int begin, int end) {
+    KeyTableJob* job = (KeyTableJob*)ctx;
+    int bytes = (rounds - 6) * 4;
+    for (int k = begin; k < end; k++) {
+        cachedKeyExpansion(job->rawKeys + (size_t)k * bytes,
+                           job->keys ? job->keys + (size_t)k * MAX_KEY_SCHEDULE : NULL,
+                           job->decKeys ? job->decKeys + (size_t)k * MAX_KEY_SCHEDULE : NULL);
+    }
+}
+
+/**
+ * Fills the key tables of a batch from numKeys raw keys of the current key
+ * size, packed one after the other. Keys the cache has seen before, the
+ * usual case for a service whose clients come back, are not expanded
+ * again. Either table may be NULL
+ */
+void batchKeys (int numKeys, const unsigned char* rawKeys, unsigned char* keys, unsigned char* decKeys) {
+    KeyTableJob job = {rawKeys, keys, decKeys};
+    poolFor(numKeys, BATCH_GRAIN, keyTableBody, &job);
+}
+
+void batchEncrypt (int count, const BatchEntry* entries, unsigned char* data, unsigned char* keys) {
+    BatchJob job = {entries, data, keys, false};
+    poolFor(count, BATCH_GRAIN, batchBody, &job);
+}
+
+void batchDecrypt (int count, const BatchEntry* entries, unsigned char* data, unsigned char* decKeys) {
+    BatchJob job = {entries, data, decKeys, true};
+    poolFor(count, BATCH_GRAIN, batchBody, &job);
+}
@@ -0,0 +1,535 @@
+/**
+ *  Bitsliced constant-time AES engine
+ *  Eight lines are processed per step as two slices of four. Each slice is
+ *  transposed into eight 64-bit bit planes: plane b holds bit b of every
+ *  byte, and byte p of block k sits at bit 16 * k + p. The S-box is then
+ *  evaluated as a Boolean circuit (Boyar-Peralta), so no table is indexed
+ *  with secret data.
+ *
+ *  Source cited: https://eprint.iacr.org/2009/129 (Kasper, Schwabe)
+ *                https://eprint.iacr.org/2011/332 (Boyar, Peralta)
+ */
+#include <stdint.h>
+#include "aes.h"
+
+#define MAX_WIDTH 16
+// number of lines in one slice
+#define SLICE 4
+// number of lines per batch
+#define BATCH 8
+
+/**
+ * Load 4 lines and transpose them into bit planes
+ */
+static void transpose (uint64_t* q) {
+    uint64_t a, b;
+    // 8x8 bit transpose inside every word
+    for (int j = 0; j < 8; j++) {
+        uint64_t x = q[j], t;
+        t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+        x = x ^ t ^ (t << 7);
+        t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+        x = x ^ t ^ (t << 14);
+        t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+        x = x ^ t ^ (t << 28);
+        q[j] = x;
+    }
+    // 8x8 byte transpose across the words
+#define SWAPN(m, s, x, y) do { a = x; b = y; \
+        x = (a & (m)) | ((b & (m)) << (s)); \
+        y = ((a >> (s)) & (m)) | (b & ~(m)); } while (0)
+    for (int j = 0; j < 8; j += 2) {
+        SWAPN(0x00FF00FF00FF00FFULL, 8, q[j], q[j + 1]);
+    }
+    for (int j = 0; j < 8; j += 4) {
+        SWAPN(0x0000FFFF0000FFFFULL, 16, q[j], q[j + 2]);
+        SWAPN(0x0000FFFF0000FFFFULL, 16, q[j + 1], q[j + 3]);
+    }
+    for (int j = 0; j < 4; j++) {
+        SWAPN(0x00000000FFFFFFFFULL, 32, q[j], q[j + 4]);
+    }
+#undef SWAPN
+}
+
+/**
+ * The byte transpose and the bit transpose are both involutions,
+ * so undoing them only needs the opposite order
+ */
+static void untranspose (uint64_t* q) {
+    uint64_t a, b;
+#define SWAPN(m, s, x, y) do { a = x; b = y; \
+        x = (a & (m)) | ((b & (m)) << (s)); \
+        y = ((a >> (s)) & (m)) | (b & ~(m)); } while (0)
+    for (int j = 0; j < 4; j++) {
+        SWAPN(0x00000000FFFFFFFFULL, 32, q[j], q[j + 4]);
+    }
+    for (int j = 0; j < 8; j += 4) {
+        SWAPN(0x0000FFFF0000FFFFULL, 16, q[j], q[j + 2]);
+        SWAPN(0x0000FFFF0000FFFFULL, 16, q[j + 1], q[j + 3]);
+    }
+    for (int j = 0; j < 8; j += 2) {
+        SWAPN(0x00FF00FF00FF00FFULL, 8, q[j], q[j + 1]);
+    }
+#undef SWAPN
+    for (int j = 0; j < 8; j++) {
+        uint64_t x = q[j], t;
+        t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+        x = x ^ t ^ (t << 7);
+        t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+        x = x ^ t ^ (t << 14);
+        t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+        x = x ^ t ^ (t << 28);
+        q[j] = x;
+    }
+}
+
+static void loadSlice (uint64_t* q, const unsigned char* in) {
+    for (int j = 0; j < 8; j++) {
+        uint64_t x = 0;
+        for (int k = 7; k >= 0; k--) {
+            x = (x << 8) | in[8 * j + k];
+        }
+        q[j] = x;
+    }
+    transpose(q);
+}
+
+static void storeSlice (unsigned char* out, uint64_t* q) {
+    untranspose(q);
+    for (int j = 0; j < 8; j++) {
+        uint64_t x = q[j];
+        for (int k = 0; k < 8; k++) {
+            out[8 * j + k] = (unsigned char)(x >> (8 * k));
+        }
+    }
+}
+
+/**
+ * Forward S-box circuit, 113 gates
+ */
+static void sboxCircuit (uint64_t* q) {
+    uint64_t x0, x1, x2, x3, x4, x5, x6, x7;
+    uint64_t y1, y2, y3, y4, y5, y6, y7, y8, y9;
+    uint64_t y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+    uint64_t y20, y21;
+    uint64_t z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+    uint64_t z10, z11, z12, z13, z14, z15, z16, z17;
+    uint64_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+    uint64_t t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+    uint64_t t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+    uint64_t t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+    uint64_t t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+    uint64_t t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+    uint64_t t60, t61, t62, t63, t64, t65, t66, t67;
+    uint64_t s0, s1, s2, s3, s4, s5, s6, s7;
+
+    x0 = q[7];
+    x1 = q[6];
+    x2 = q[5];
+    x3 = q[4];
+    x4 = q[3];
+    x5 = q[2];
+    x6 = q[1];
+    x7 = q[0];
+
+    // top linear transformation
+    y14 = x3 ^ x5;
+    y13 = x0 ^ x6;
+    y9 = x0 ^ x3;
+    y8 = x0 ^ x5;
+    t0 = x1 ^ x2;
+    y1 = t0 ^ x7;
+    y4 = y1 ^ x3;
+    y12 = y13 ^ y14;
+    y2 = y1 ^ x0;
+    y5 = y1 ^ x6;
+    y3 = y5 ^ y8;
+    t1 = x4 ^ y12;
+    y15 = t1 ^ x5;
+    y20 = t1 ^ x1;
+    y6 = y15 ^ x7;
+    y10 = y15 ^ t0;
+    y11 = y20 ^ y9;
+    y7 = x7 ^ y11;
+    y17 = y10 ^ y11;
+    y19 = y10 ^ y8;
+    y16 = t0 ^ y11;
+    y21 = y13 ^ y16;
+    y18 = x0 ^ y16;
+
+    // non-linear section
+    t2 = y12 & y15;
+    t3 = y3 & y6;
+    t4 = t3 ^ t2;
+    t5 = y4 & x7;
+    t6 = t5 ^ t2;
+    t7 = y13 & y16;
+    t8 = y5 & y1;
+    t9 = t8 ^ t7;
+    t10 = y2 & y7;
+    t11 = t10 ^ t7;
+    t12 = y9 & y11;
+    t13 = y14 & y17;
+    t14 = t13 ^ t12;
+    t15 = y8 & y10;
+    t16 = t15 ^ t12;
+    t17 = t4 ^ t14;
+    t18 = t6 ^ t16;
+    t19 = t9 ^ t14;
+    t20 = t11 ^ t16;
+    t21 = t17 ^ y20;
+    t22 = t18 ^ y19;
+    t23 = t19 ^ y21;
+    t24 = t20 ^ y18;
+
+    t25 = t21 ^ t22;
+    t26 = t21 & t23;
+    t27 = t24 ^ t26;
+    t28 = t25 & t27;
+    t29 = t28 ^ t22;
+    t30 = t23 ^ t24;
+    t31 = t22 ^ t26;
+    t32 = t31 & t30;
+    t33 = t32 ^ t24;
+    t34 = t23 ^ t33;
+    t35 = t27 ^ t33;
+    t36 = t24 & t35;
+    t37 = t36 ^ t34;
+    t38 = t27 ^ t36;
+    t39 = t29 & t38;
+    t40 = t25 ^ t39;
+
+    t41 = t40 ^ t37;
+    t42 = t29 ^ t33;
+    t43 = t29 ^ t40;
+    t44 = t33 ^ t37;
+    t45 = t42 ^ t41;
+    z0 = t44 & y15;
+    z1 = t37 & y6;
+    z2 = t33 & x7;
+    z3 = t43 & y16;
+    z4 = t40 & y1;
+    z5 = t29 & y7;
+    z6 = t42 & y11;
+    z7 = t45 & y17;
+    z8 = t41 & y10;
+    z9 = t44 & y12;
+    z10 = t37 & y3;
+    z11 = t33 & y4;
+    z12 = t43 & y13;
+    z13 = t40 & y5;
+    z14 = t29 & y2;
+    z15 = t42 & y9;
+    z16 = t45 & y14;
+    z17 = t41 & y8;
+
+    // bottom linear transformation
+    t46 = z15 ^ z16;
+    t47 = z10 ^ z11;
+    t48 = z5 ^ z13;
+    t49 = z9 ^ z10;
+    t50 = z2 ^ z12;
+    t51 = z2 ^ z5;
+    t52 = z7 ^ z8;
+    t53 = z0 ^ z3;
+    t54 = z6 ^ z7;
+    t55 = z16 ^ z17;
+    t56 = z12 ^ t48;
+    t57 = t50 ^ t53;
+    t58 = z4 ^ t46;
+    t59 = z3 ^ t54;
+    t60 = t46 ^ t57;
+    t61 = z14 ^ t57;
+    t62 = t52 ^ t58;
+    t63 = t49 ^ t58;
+    t64 = z4 ^ t59;
+    t65 = t61 ^ t62;
+    t66 = z1 ^ t63;
+    s0 = t59 ^ t63;
+    s6 = t56 ^ ~t62;
+    s7 = t48 ^ ~t60;
+    t67 = t64 ^ t65;
+    s3 = t53 ^ t66;
+    s4 = t51 ^ t66;
+    s5 = t47 ^ t65;
+    s1 = t64 ^ ~s3;
+    s2 = t55 ^ ~t67;
+
+    q[7] = s0;
+    q[6] = s1;
+    q[5] = s2;
+    q[4] = s3;
+    q[3] = s4;
+    q[2] = s5;
+    q[1] = s6;
+    q[0] = s7;
+}
+
+/**
+ * Inverse of the S-box affine map, including the 0x63 constant
+ */
+static void invAffine (uint64_t* q) {
+    uint64_t q0 = ~q[0], q1 = ~q[1], q2 = q[2], q3 = q[3];
+    uint64_t q4 = q[4], q5 = ~q[5], q6 = ~q[6], q7 = q[7];
+    q[7] = q1 ^ q4 ^ q6;
+    q[6] = q0 ^ q3 ^ q5;
+    q[5] = q7 ^ q2 ^ q4;
+    q[4] = q6 ^ q1 ^ q3;
+    q[3] = q5 ^ q0 ^ q2;
+    q[2] = q4 ^ q7 ^ q1;
+    q[1] = q3 ^ q6 ^ q0;
+    q[0] = q2 ^ q5 ^ q7;
+}
+
+/**
+ * Since inversion in GF(2^8) is an involution, the inverse S-box is
+ * invAffine(S(invAffine(x)))
+ */
+static void invSboxCircuit (uint64_t* q) {
+    invAffine(q);
+    sboxCircuit(q);
+    invAffine(q);
+}
+
+// byte 4c + r of every block sits at bit 4c + r of a 16-bit lane
+#define ROW0 0x1111111111111111ULL
+#define ROW1 0x2222222222222222ULL
+#define ROW2 0x4444444444444444ULL
+#define ROW3 0x8888888888888888ULL
+
+// rotate every 16-bit lane right by n bits
+static inline uint64_t rot16 (uint64_t x, int n) {
+    uint64_t lo = 0x0001000100010001ULL * (0xFFFFu >> n);
+    return ((x >> n) & lo) | ((x << (16 - n)) & ~lo);
+}
+
+static void bsShiftRows (uint64_t* q) {
+    for (int b = 0; b < 8; b++) {
+        uint64_t x = q[b];
+        q[b] = (x & ROW0) | (rot16(x, 4) & ROW1) | (rot16(x, 8) & ROW2) | (rot16(x, 12) & ROW3);
+    }
+}
+
+static void bsInvShiftRows (uint64_t* q) {
+    for (int b = 0; b < 8; b++) {
+        uint64_t x = q[b];
+        q[b] = (x & ROW0) | (rot16(x, 12) & ROW1) | (rot16(x, 8) & ROW2) | (rot16(x, 4) & ROW3);
+    }
+}
+
+// the byte one, two or three rows further down the same column
+#define NEXT1(x) ((((x) >> 1) & 0x7777777777777777ULL) | (((x) << 3) & 0x8888888888888888ULL))
+#define NEXT2(x) ((((x) >> 2) & 0x3333333333333333ULL) | (((x) << 2) & 0xCCCCCCCCCCCCCCCCULL))
+#define NEXT3(x) ((((x) >> 3) & 0x1111111111111111ULL) | (((x) << 1) & 0xEEEEEEEEEEEEEEEEULL))
+
+// multiply every byte by x in GF(2^8), 0x1b hits bits 0, 1, 3, 4
+static void bsXtime (uint64_t* q) {
+    uint64_t hi = q[7];
+    q[7] = q[6];
+    q[6] = q[5];
+    q[5] = q[4];
+    q[4] = q[3] ^ hi;
+    q[3] = q[2] ^ hi;
+    q[2] = q[1];
+    q[1] = q[0] ^ hi;
+    q[0] = hi;
+}
+
+static void bsMixColumns (uint64_t* q) {
+    uint64_t t[8];
+    for (int b = 0; b < 8; b++) {
+        t[b] = q[b] ^ NEXT1(q[b]);
+    }
+    bsXtime(t);
+    for (int b = 0; b < 8; b++) {
+        q[b] = t[b] ^ NEXT1(q[b]) ^ NEXT2(q[b]) ^ NEXT3(q[b]);
+    }
+}
+
+/**
+ * InvMixColumns is MixColumns after a_r ^= 4 * (a_r ^ a_{r+2})
+ */
+static void bsInvMixColumns (uint64_t* q) {
+    uint64_t t[8];
+    for (int b = 0; b < 8; b++) {
+        t[b] = q[b] ^ NEXT2(q[b]);
+    }
+    bsXtime(t);
+    bsXtime(t);
+    for (int b = 0; b < 8; b++) {
+        q[b] ^= t[b];
+    }
+    bsMixColumns(q);
+}
+
+static void bsAddRoundKey (uint64_t* q, const uint64_t* sk) {
+    for (int b = 0; b < 8; b++) {
+        q[b] ^= sk[b];
+    }
+}
+
+/**
+ * Replicate every round key into all four blocks of a slice
+ */
+static void sliceKeys (unsigned char* key, uint64_t sk[MAX_ROUND + 1][8]) {
+    unsigned char rk[MAX_WIDTH * SLICE];
+    for (int i = 0; i <= rounds; i++) {
+        for (int k = 0; k < SLICE; k++) {
+            memcpy(rk + MAX_WIDTH * k, key + MAX_WIDTH * i, MAX_WIDTH);
+        }
+        loadSlice(sk[i], rk);
+    }
+}
+
+/**
+ * Rounds I to Nr on one slice, unrolled by recursion on I
+ * Decryption follows the equivalent inverse cipher with keys from
+ * keyExpansionInv(), round I using round key Nr - I.
+ */
+template <int I, int Nr> struct SliceRounds {
+    static inline void encrypt (uint64_t* q, uint64_t sk[MAX_ROUND + 1][8]) {
+        sboxCircuit(q);
+        bsShiftRows(q);
+        bsMixColumns(q);
+        bsAddRoundKey(q, sk[I]);
+        SliceRounds<I + 1, Nr>::encrypt(q, sk);
+    }
+
+    static inline void decrypt (uint64_t* q, uint64_t sk[MAX_ROUND + 1][8]) {
+        bsInvShiftRows(q);
+        invSboxCircuit(q);
+        bsInvMixColumns(q);
+        bsAddRoundKey(q, sk[Nr - I]);
+        SliceRounds<I + 1, Nr>::decrypt(q, sk);
+    }
+};
+
+template <int Nr> struct SliceRounds<Nr, Nr> {
+    static inline void encrypt (uint64_t* q, uint64_t sk[MAX_ROUND + 1][8]) {
+        sboxCircuit(q);
+        bsShiftRows(q);
+        bsAddRoundKey(q, sk[Nr]);
+    }
+
+    static inline void decrypt (uint64_t* q, uint64_t sk[MAX_ROUND + 1][8]) {
+        bsInvShiftRows(q);
+        invSboxCircuit(q);
+        bsAddRoundKey(q, sk[0]);
+    }
+};
+
+/**
+ * Run one batch of up to 8 lines, a short batch is padded in a local buffer
+ */
+template <int Nr> static void bitsliceBatch (int lines, unsigned char* state, uint64_t sk[MAX_ROUND + 1][8], bool inverse) {
+    unsigned char pad[MAX_WIDTH * BATCH];
+    unsigned char* p = state;
+    uint64_t q[8];
+    if (lines < BATCH) {
+        memset(pad, 0, sizeof(pad));
+        memcpy(pad, state, lines * MAX_WIDTH);
+        p = pad;
+    }
+    for (int s = 0; s < BATCH / SLICE; s++) {
+        loadSlice(q, p + MAX_WIDTH * SLICE * s);
+        if (inverse) {
+            bsAddRoundKey(q, sk[Nr]);
+            SliceRounds<1, Nr>::decrypt(q, sk);
+        } else {
+            bsAddRoundKey(q, sk[0]);
+            SliceRounds<1, Nr>::encrypt(q, sk);
+        }
+        storeSlice(p + MAX_WIDTH * SLICE * s, q);
+    }
+    if (p == pad) {
+        memcpy(state, pad, lines * MAX_WIDTH);
+    }
+}
+
+template <int Nr> static void bitsliceLines (int lines, unsigned char* state, uint64_t sk[MAX_ROUND + 1][8], bool inverse) {
+    for (int i = 0; i < lines; i += BATCH) {
+        bitsliceBatch<Nr>(lines - i < BATCH ? lines - i : BATCH, state + i * MAX_WIDTH, sk, inverse);
+    }
+}
+
+static void bitsliceRun (int lines, unsigned char* state, unsigned char* key, bool inverse) {
+    uint64_t sk[MAX_ROUND + 1][8];
+    sliceKeys(key, sk);
+    switch (rounds) {
+        case 12:
+            bitsliceLines<12>(lines, state, sk, inverse);
+            break;
+        case 14:
+            bitsliceLines<14>(lines, state, sk, inverse);
+            break;
+        default:
+            bitsliceLines<10>(lines, state, sk, inverse);
+            break;
+    }
+}
+
+/**
+ * One line per lane, every lane with its own schedule: each slice gets
+ * round keys sliced from the schedules of its four lanes. Missing lanes
+ * run lane 0 again and are not stored.
+ */
+template <int Nr> static void bitsliceLanes (int lanes, unsigned char** lines, unsigned char** keys, bool inverse) {
+    uint64_t sk[MAX_ROUND + 1][8];
+    unsigned char block[MAX_WIDTH * SLICE];
+    uint64_t q[8];
+    for (int s = 0; s * SLICE < lanes; s++) {
+        for (int i = 0; i <= Nr; i++) {
+            for (int k = 0; k < SLICE; k++) {
+                int lane = s * SLICE + k < lanes ? s * SLICE + k : 0;
+                memcpy(block + MAX_WIDTH * k, keys[lane] + MAX_WIDTH * i, MAX_WIDTH);
+            }
+            loadSlice(sk[i], block);
+        }
+        for (int k = 0; k < SLICE; k++) {
+            int lane = s * SLICE + k < lanes ? s * SLICE + k : 0;
+            memcpy(block + MAX_WIDTH * k, lines[lane], MAX_WIDTH);
+        }
+        loadSlice(q, block);
+        if (inverse) {
+            bsAddRoundKey(q, sk[Nr]);
+            SliceRounds<1, Nr>::decrypt(q, sk);
+        } else {
+            bsAddRoundKey(q, sk[0]);
+            SliceRounds<1, Nr>::encrypt(q, sk);
+        }
+        storeSlice(block, q);
+        for (int k = 0; k < SLICE && s * SLICE + k < lanes; k++) {
+            memcpy(lines[s * SLICE + k], block + MAX_WIDTH * k, MAX_WIDTH);
+        }
+    }
+}
+
+static void bitsliceLaneRun (int lanes, unsigned char** lines, unsigned char** keys, bool inverse) {
+    switch (rounds) {
+        case 12:
+            bitsliceLanes<12>(lanes, lines, keys, inverse);
+            break;
+        case 14:
+            bitsliceLanes<14>(lanes, lines, keys, inverse);
+            break;
+        default:
+            bitsliceLanes<10>(lanes, lines, keys, inverse);
+            break;
+    }
+}
+
+void bitsliceEncryptLanes (int lanes, unsigned char** lines, unsigned char** keys) {
+    bitsliceLaneRun(lanes, lines, keys, false);
+}
+
+void bitsliceDecryptLanes (int lanes, unsigned char** lines, unsigned char** decKeys) {
+    bitsliceLaneRun(lanes, lines, decKeys, true);
+}
+
+void bitsliceEncrypt (int lines, unsigned char* state, unsigned char* key) {
+    bitsliceRun(lines, state, key, false);
+}
+
+void bitsliceDecrypt (int lines, unsigned char* state, unsigned char* decKey) {
+    bitsliceRun(lines, state, decKey, true);
+}
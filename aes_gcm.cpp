@@ -0,0 +1,354 @@
+/**
+ *  AES-GCM authenticated encryption (128, 192 or 256-bit keys)
+ *  The keystream is made a batch of lines at a time through encrypt(), and
+ *  the batch is folded into GHASH while it is still in L1, so every line of
+ *  the message is read from memory once.
+ *
+ *  GHASH uses PCLMULQDQ with a 4-block aggregated reduction when the CPU has
+ *  it, and 4-bit tables (Shoup's method) otherwise.
+ *
+ *  Source cited: https://csrc.nist.rip/groups/ST/toolkit/BCM/documents/proposedmodes/gcm/gcm-spec.pdf
+ *                https://www.intel.com/content/dam/develop/external/us/en/documents/clmul-wp-rev-2-02-2014-04-20.pdf
+ */
+#include <stdint.h>
+#include "aes.h"
+
+#define MAX_WIDTH 16
+// lines of keystream made per encrypt() call
+#define GCM_BATCH 32
+
+struct Ghash {
+    uint64_t HL[16], HH[16];        // 4-bit multiplication tables
+    unsigned char hpow[4][MAX_WIDTH];  // H^1..H^4, byte reversed, for PCLMULQDQ
+    unsigned char y[MAX_WIDTH];
+    int clmul;
+};
+
+static uint64_t loadBE64 (const unsigned char* p) {
+    uint64_t x = 0;
+    for (int i = 0; i < 8; i++) {
+        x = (x << 8) | p[i];
+    }
+    return x;
+}
+
+static void storeBE64 (unsigned char* p, uint64_t x) {
+    for (int i = 7; i >= 0; i--) {
+        p[i] = (unsigned char)x;
+        x >>= 8;
+    }
+}
+
+/**
+ * Bit-serial multiplication in GF(2^128), Algorithm 1 of the GCM spec
+ * Only used for setup, z may alias x or y
+ */
+void gfMultiply (const unsigned char* x, const unsigned char* y, unsigned char* z) {
+    uint64_t zh = 0, zl = 0;
+    uint64_t vh = loadBE64(y), vl = loadBE64(y + 8);
+    for (int i = 0; i < 128; i++) {
+        if ((x[i / 8] >> (7 - i % 8)) & 1) {
+            zh ^= vh;
+            zl ^= vl;
+        }
+        uint64_t carry = vl & 1;
+        vl = (vl >> 1) | (vh << 63);
+        vh >>= 1;
+        if (carry) {
+            vh ^= 0xe100000000000000ULL;
+        }
+    }
+    storeBE64(z, zh);
+    storeBE64(z + 8, zl);
+}
+
+static const uint64_t last4[16] = {
+    0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+    0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+};
+
+static void tableMultiply (Ghash* g, unsigned char* x) {
+    unsigned char lo = x[15] & 0xf, hi, rem;
+    uint64_t zh = g->HH[lo], zl = g->HL[lo];
+    for (int i = 15; i >= 0; i--) {
+        lo = x[i] & 0xf;
+        hi = x[i] >> 4;
+        if (i != 15) {
+            rem = (unsigned char)zl & 0xf;
+            zl = (zh << 60) | (zl >> 4);
+            zh = (zh >> 4) ^ (last4[rem] << 48);
+            zh ^= g->HH[lo];
+            zl ^= g->HL[lo];
+        }
+        rem = (unsigned char)zl & 0xf;
+        zl = (zh << 60) | (zl >> 4);
+        zh = (zh >> 4) ^ (last4[rem] << 48);
+        zh ^= g->HH[hi];
+        zl ^= g->HL[hi];
+    }
+    storeBE64(x, zh);
+    storeBE64(x + 8, zl);
+}
+
+static void tableUpdate (Ghash* g, const unsigned char* blocks, int n) {
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < MAX_WIDTH; j++) {
+            g->y[j] ^= blocks[MAX_WIDTH * i + j];
+        }
+        tableMultiply(g, g->y);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+
+#define CLMUL __attribute__((target("pclmul,ssse3")))
+
+static int clmulSupported () {
+    unsigned int a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d)) {
+        return 0;
+    }
+    return (c & bit_PCLMUL) && (c & bit_SSSE3);
+}
+
+/**
+ * 256-bit carry-less product of two byte-reversed blocks, not yet reduced
+ */
+CLMUL static inline void clmulWide (__m128i a, __m128i b, __m128i* lo, __m128i* hi) {
+    __m128i t0 = _mm_clmulepi64_si128(a, b, 0x00);
+    __m128i t1 = _mm_clmulepi64_si128(a, b, 0x10);
+    __m128i t2 = _mm_clmulepi64_si128(a, b, 0x01);
+    __m128i t3 = _mm_clmulepi64_si128(a, b, 0x11);
+    t1 = _mm_xor_si128(t1, t2);
+    *lo = _mm_xor_si128(t0, _mm_slli_si128(t1, 8));
+    *hi = _mm_xor_si128(t3, _mm_srli_si128(t1, 8));
+}
+
+/**
+ * Shift the bit-reflected product left by one and reduce it modulo
+ * x^128 + x^7 + x^2 + x + 1
+ */
+CLMUL static inline __m128i clmulReduce (__m128i lo, __m128i hi) {
+    __m128i t7 = _mm_srli_epi32(lo, 31);
+    __m128i t8 = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    __m128i t9 = _mm_srli_si128(t7, 12);
+    t8 = _mm_slli_si128(t8, 4);
+    t7 = _mm_slli_si128(t7, 4);
+    lo = _mm_or_si128(lo, t7);
+    hi = _mm_or_si128(_mm_or_si128(hi, t8), t9);
+
+    t7 = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+    t8 = _mm_srli_si128(t7, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(t7, 12));
+    __m128i t2 = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+    t2 = _mm_xor_si128(t2, t8);
+    lo = _mm_xor_si128(lo, t2);
+    return _mm_xor_si128(hi, lo);
+}
+
+CLMUL static void clmulUpdate (Ghash* g, const unsigned char* blocks, int n) {
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i h1 = _mm_loadu_si128((__m128i*)g->hpow[0]);
+    __m128i h2 = _mm_loadu_si128((__m128i*)g->hpow[1]);
+    __m128i h3 = _mm_loadu_si128((__m128i*)g->hpow[2]);
+    __m128i h4 = _mm_loadu_si128((__m128i*)g->hpow[3]);
+    __m128i y = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)g->y), bswap);
+    __m128i lo, hi, l, h;
+    int i = 0;
+    // Y' = (Y ^ X1) * H^4 ^ X2 * H^3 ^ X3 * H^2 ^ X4 * H, reduced once
+    for (; i + 4 <= n; i += 4) {
+        const __m128i* p = (const __m128i*)(blocks + MAX_WIDTH * i);
+        __m128i x1 = _mm_xor_si128(y, _mm_shuffle_epi8(_mm_loadu_si128(p), bswap));
+        __m128i x2 = _mm_shuffle_epi8(_mm_loadu_si128(p + 1), bswap);
+        __m128i x3 = _mm_shuffle_epi8(_mm_loadu_si128(p + 2), bswap);
+        __m128i x4 = _mm_shuffle_epi8(_mm_loadu_si128(p + 3), bswap);
+        clmulWide(x1, h4, &lo, &hi);
+        clmulWide(x2, h3, &l, &h);
+        lo = _mm_xor_si128(lo, l);
+        hi = _mm_xor_si128(hi, h);
+        clmulWide(x3, h2, &l, &h);
+        lo = _mm_xor_si128(lo, l);
+        hi = _mm_xor_si128(hi, h);
+        clmulWide(x4, h1, &l, &h);
+        lo = _mm_xor_si128(lo, l);
+        hi = _mm_xor_si128(hi, h);
+        y = clmulReduce(lo, hi);
+    }
+    for (; i < n; i++) {
+        __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(blocks + MAX_WIDTH * i)), bswap);
+        clmulWide(_mm_xor_si128(y, x), h1, &lo, &hi);
+        y = clmulReduce(lo, hi);
+    }
+    _mm_storeu_si128((__m128i*)g->y, _mm_shuffle_epi8(y, bswap));
+}
+
+#else
+
+static int clmulSupported () {
+    return 0;
+}
+
+static void clmulUpdate (Ghash* g, const unsigned char* blocks, int n) {
+    tableUpdate(g, blocks, n);
+}
+
+#endif
+
+static void ghashInit (Ghash* g, const unsigned char* h) {
+    memset(g, 0, sizeof(Ghash));
+    g->clmul = clmulSupported();
+
+    // HH/HL[8] = H, HH/HL[4, 2, 1] = H * x, x^2, x^3, the rest are sums
+    uint64_t vh = loadBE64(h), vl = loadBE64(h + 8);
+    g->HH[8] = vh;
+    g->HL[8] = vl;
+    for (int i = 4; i > 0; i >>= 1) {
+        uint64_t t = (vl & 1) * 0xe1000000ULL;
+        vl = (vh << 63) | (vl >> 1);
+        vh = (vh >> 1) ^ (t << 32);
+        g->HL[i] = vl;
+        g->HH[i] = vh;
+    }
+    for (int i = 2; i <= 8; i *= 2) {
+        for (int j = 1; j < i; j++) {
+            g->HH[i + j] = g->HH[i] ^ g->HH[j];
+            g->HL[i + j] = g->HL[i] ^ g->HL[j];
+        }
+    }
+
+    unsigned char p[MAX_WIDTH];
+    memcpy(p, h, MAX_WIDTH);
+    for (int k = 0; k < 4; k++) {
+        if (k > 0) {
+            gfMultiply(p, h, p);
+        }
+        for (int j = 0; j < MAX_WIDTH; j++) {
+            g->hpow[k][j] = p[MAX_WIDTH - 1 - j];
+        }
+    }
+}
+
+/**
+ * Absorb whole 16-byte blocks
+ */
+static void ghashUpdate (Ghash* g, const unsigned char* blocks, int n) {
+    if (g->clmul) {
+        clmulUpdate(g, blocks, n);
+    } else {
+        tableUpdate(g, blocks, n);
+    }
+}
+
+/**
+ * Absorb any number of bytes, the last block is padded with zeros
+ */
+static void ghashBytes (Ghash* g, const unsigned char* data, size_t len) {
+    ghashUpdate(g, data, (int)(len / MAX_WIDTH));
+    if (len % MAX_WIDTH) {
+        unsigned char last[MAX_WIDTH] = {0};
+        memcpy(last, data + len - len % MAX_WIDTH, len % MAX_WIDTH);
+        ghashUpdate(g, last, 1);
+    }
+}
+
+/**
+ * GHASH of whole lines with hash key h, y is both the starting value and
+ * the result
+ */
+void ghash (const unsigned char* h, const unsigned char* data, int lines, unsigned char* y) {
+    Ghash g;
+    ghashInit(&g, h);
+    memcpy(g.y, y, MAX_WIDTH);
+    ghashUpdate(&g, data, lines);
+    memcpy(y, g.y, MAX_WIDTH);
+}
+
+/**
+ * The GCM core: H, J0 and the AAD are set up, then the message is handled a
+ * batch at a time. GHASH runs over the ciphertext, which is the output when
+ * encrypting and the input when decrypting.
+ */
+static void gcmCrypt (unsigned char* data, size_t len, const unsigned char* aad, size_t aadLen,
+                      unsigned char* key, const unsigned char* iv, unsigned char* tag, bool decrypting) {
+    unsigned char ks[MAX_WIDTH * GCM_BATCH];
+    unsigned char h[MAX_WIDTH] = {0};
+    unsigned char j0[MAX_WIDTH];
+    Ghash g;
+
+    encrypt(1, h, key);
+    ghashInit(&g, h);
+    ghashBytes(&g, aad, aadLen);
+
+    // 96-bit iv: J0 = iv || 0^31 || 1
+    memcpy(j0, iv, 12);
+    j0[12] = j0[13] = j0[14] = 0;
+    j0[15] = 1;
+    unsigned int counter = 1;
+
+    for (size_t off = 0; off < len; off += MAX_WIDTH * GCM_BATCH) {
+        size_t n = len - off < MAX_WIDTH * GCM_BATCH ? len - off : MAX_WIDTH * GCM_BATCH;
+        int lines = (int)((n + MAX_WIDTH - 1) / MAX_WIDTH);
+        for (int i = 0; i < lines; i++) {
+            counter++;
+            memcpy(ks + MAX_WIDTH * i, j0, 12);
+            ks[MAX_WIDTH * i + 12] = (unsigned char)(counter >> 24);
+            ks[MAX_WIDTH * i + 13] = (unsigned char)(counter >> 16);
+            ks[MAX_WIDTH * i + 14] = (unsigned char)(counter >> 8);
+            ks[MAX_WIDTH * i + 15] = (unsigned char)counter;
+        }
+        encrypt(lines, ks, key);
+        unsigned char* p = data + off;
+        if (decrypting) {
+            ghashBytes(&g, p, n);
+        }
+        for (size_t j = 0; j < n; j++) {
+            p[j] ^= ks[j];
+        }
+        if (!decrypting) {
+            ghashBytes(&g, p, n);
+        }
+    }
+
+    unsigned char lengths[MAX_WIDTH];
+    storeBE64(lengths, (uint64_t)aadLen * 8);
+    storeBE64(lengths + 8, (uint64_t)len * 8);
+    ghashUpdate(&g, lengths, 1);
+
+    encrypt(1, j0, key);
+    for (int i = 0; i < MAX_WIDTH; i++) {
+        tag[i] = j0[i] ^ g.y[i];
+    }
+}
+
+/**
+ * Encrypt len bytes in place and produce a 16-byte tag
+ * key is the expanded key, iv is 12 bytes
+ */
+void gcmEncrypt (unsigned char* data, size_t len, const unsigned char* aad, size_t aadLen,
+                 unsigned char* key, const unsigned char* iv, unsigned char* tag) {
+    gcmCrypt(data, len, aad, aadLen, key, iv, tag, false);
+}
+
+/**
+ * Decrypt len bytes in place and check the tag
+ * Returns 0 when the tag matches, otherwise -1 with data wiped
+ */
+int gcmDecrypt (unsigned char* data, size_t len, const unsigned char* aad, size_t aadLen,
+                unsigned char* key, const unsigned char* iv, const unsigned char* tag) {
+    unsigned char expected[MAX_WIDTH];
+    unsigned char diff = 0;
+    gcmCrypt(data, len, aad, aadLen, key, iv, expected, true);
+    for (int i = 0; i < MAX_WIDTH; i++) {
+        diff |= expected[i] ^ tag[i];
+    }
+    if (diff != 0) {
+        memset(data, 0, len);
+        return -1;
+    }
+    return 0;
+}
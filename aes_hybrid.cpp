@@ -0,0 +1,197 @@
+/**
+ *  CPU + accelerator co-scheduling
+ *  A job is a queue of lines that the CPU (through the worker pool) and the
+ *  OpenCL session pull pieces from as they finish the previous one. A
+ *  feeder thread drives the accelerator while the calling thread drives
+ *  the pool, so neither side waits for the other.
+ *
+ *  Both sides measure their lines per second. Once both rates are known a
+ *  piece is the side's share of half the remaining lines, so the pieces
+ *  shrink towards the end of the job and both sides run out at about the
+ *  same time. The rates are kept across calls.
+ */
+#include <pthread.h>
+#include "aes.h"
+
+#define MAX_WIDTH 16
+// smallest piece of the CPU, per pool worker
+#define CPU_PIECE 2048
+// smallest piece of the accelerator, every piece pays a request
+#define ACCEL_PIECE 16384
+
+enum {
+    HYBRID_ENCRYPT = 0,
+    HYBRID_DECRYPT,
+    HYBRID_CTR
+};
+
+struct HybridJob {
+    int op;
+    int lines;
+    unsigned char* data;
+    unsigned char* key;
+    unsigned char* decKey;
+    const unsigned char* iv;
+    unsigned long long block;
+    int next;                   // first line not handed out yet, atomic
+    int accelLines;             // lines the accelerator did
+};
+
+// lines per second of each side, 0 until measured. Both threads read
+// them, each is only written by its own side, so a plain atomic load and
+// store is enough
+static double cpuRate = 0;
+static double accelRate = 0;
+
+static double loadRate (double* rate) {
+    double r;
+    __atomic_load(rate, &r, __ATOMIC_RELAXED);
+    return r;
+}
+
+static double now () {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// average the new measurement in
+static void measure (double* rate, int lines, double seconds) {
+    if (seconds <= 0) {
+        return;
+    }
+    double r = lines / seconds;
+    double old = loadRate(rate);
+    r = old > 0 ? (old + r) / 2 : r;
+    __atomic_store(rate, &r, __ATOMIC_RELAXED);
+}
+
+/**
+ * Take the next piece of at least min lines for the side whose rate is own
+ * Returns its size, 0 once the job is drained
+ */
+static int take (HybridJob* job, double* own, int min, int* begin) {
+    for (;;) {
+        int start = __atomic_load_n(&job->next, __ATOMIC_RELAXED);
+        int left = job->lines - start;
+        if (left <= 0) {
+            return 0;
+        }
+        int n = min;
+        double rate = loadRate(own);
+        double cpu = loadRate(&cpuRate);
+        double accel = loadRate(&accelRate);
+        double total = cpu + accel;
+        if (cpu > 0 && accel > 0) {
+            int share = (int)(left * (rate / total) / 2);
+            if (share > n) {
+                n = share;
+            }
+        }
+        if (n > left) {
+            n = left;
+        }
+        if (__sync_bool_compare_and_swap(&job->next, start, start + n)) {
+            *begin = start;
+            return n;
+        }
+    }
+}
+
+static void cpuPiece (HybridJob* job, int begin, int n) {
+    unsigned char* p = job->data + (size_t)begin * MAX_WIDTH;
+    switch (job->op) {
+        case HYBRID_ENCRYPT:
+            parallelEncrypt(n, p, job->key);
+            break;
+        case HYBRID_DECRYPT:
+            parallelDecrypt(n, p, job->decKey);
+            break;
+        default:
+            parallelCtr(n, p, job->key, job->iv, job->block + begin);
+            break;
+    }
+}
+
+// Returns 0 on success
+static int accelPiece (HybridJob* job, int begin, int n) {
+    unsigned char* p = job->data + (size_t)begin * MAX_WIDTH;
+    switch (job->op) {
+        case HYBRID_ENCRYPT:
+            return encryption_fpga(n, p, job->key);
+        case HYBRID_DECRYPT:
+            return decryption_fpga(n, p, job->key);
+        default:
+            return ctr_fpga(n, p, job->key, job->iv, job->block + begin);
+    }
+}
+
+/**
+ * The feeder thread. A piece the accelerator fails on is finished here on
+ * one core, the pool belongs to the calling thread, and the CPU takes the
+ * rest of the job.
+ */
+static void* accelMain (void* arg) {
+    HybridJob* job = (HybridJob*)arg;
+    if (fpga_open() != 0) {
+        return NULL;
+    }
+    int begin, n;
+    while ((n = take(job, &accelRate, ACCEL_PIECE, &begin)) > 0) {
+        double start = now();
+        if (accelPiece(job, begin, n) != 0) {
+            unsigned char* p = job->data + (size_t)begin * MAX_WIDTH;
+            if (job->op == HYBRID_ENCRYPT) {
+                encrypt(n, p, job->key);
+            } else if (job->op == HYBRID_DECRYPT) {
+                decryptInv(n, p, job->decKey);
+            } else {
+                ctrXcrypt(n, p, job->key, job->iv, job->block + begin);
+            }
+            break;
+        }
+        measure(&accelRate, n, now() - start);
+        job->accelLines += n;
+    }
+    return NULL;
+}
+
+static int hybridRun (HybridJob* job) {
+    job->next = 0;
+    job->accelLines = 0;
+    pthread_t feeder;
+    bool feeding = pthread_create(&feeder, NULL, accelMain, job) == 0;
+
+    int begin, n;
+    int min = CPU_PIECE * poolWorkers();
+    while ((n = take(job, &cpuRate, min, &begin)) > 0) {
+        double start = now();
+        cpuPiece(job, begin, n);
+        measure(&cpuRate, n, now() - start);
+    }
+    if (feeding) {
+        pthread_join(feeder, NULL);
+    }
+    return job->accelLines;
+}
+
+/**
+ * ECB over the CPU engine and the accelerator together
+ * Returns the number of lines the accelerator handled
+ */
+int hybridEncrypt (int lines, unsigned char* data, unsigned char* key) {
+    HybridJob job = {HYBRID_ENCRYPT, lines, data, key, NULL, NULL, 0, 0, 0};
+    return hybridRun(&job);
+}
+
+// key is the expanded key of the accelerator, decKey the one of decryptInv()
+int hybridDecrypt (int lines, unsigned char* data, unsigned char* key, unsigned char* decKey) {
+    HybridJob job = {HYBRID_DECRYPT, lines, data, key, decKey, NULL, 0, 0, 0};
+    return hybridRun(&job);
+}
+
+// CTR from block of the stream started at iv, like parallelCtr()
+int hybridCtr (int lines, unsigned char* data, unsigned char* key, const unsigned char* iv, unsigned long long block) {
+    HybridJob job = {HYBRID_CTR, lines, data, key, NULL, iv, block, 0, 0};
+    return hybridRun(&job);
+}
@@ -0,0 +1,299 @@
+/**
+ *  Streaming file I/O
+ *  A file is transformed a window at a time, so the memory in use is
+ *  bounded by the window whatever the size of the file. Regular files are
+ *  mapped: every input window is copied into the mapped output window and
+ *  transformed there while the kernel reads the next input window ahead.
+ *  Pipes and files that cannot be mapped go through a ring of aligned
+ *  arena buffers that a reader thread fills while the caller transforms and
+ *  writes the one before. Where the kernel has io_uring, regular files go
+ *  through it instead (aes_uring.cpp).
+ *  A short last line is padded with zeros, the output holds whole lines.
+ */
+#include <pthread.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "aes.h"
+
+#define MAX_WIDTH 16
+// bytes per window, a multiple of the page size
+#define IO_WINDOW (1 << 24)
+// one buffer being read, one transformed and written, one spare
+#define RING_BUFFERS 3
+// reads in flight of the io_uring path
+#define URING_DEPTH 8
+
+enum {
+    IO_AUTO = 0,
+    IO_MMAP,
+    IO_RING,
+    IO_URING
+};
+static int ioPath = IO_AUTO;
+static int ioDepth = URING_DEPTH;
+
+struct Ring {
+    int in;
+    unsigned long long left;            // bytes still to read
+    unsigned char* buffer[RING_BUFFERS];
+    size_t length[RING_BUFFERS];        // bytes read into each buffer
+    int filled;                         // buffers read so far
+    int consumed;                       // buffers written so far
+    bool failed;
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+/**
+ * Pick how streamFile() moves regular files: "auto" (io_uring where the
+ * kernel has it, else mmap), "mmap", "ring" or "uring" with depth reads in
+ * flight, 0 keeps the current depth. Pipes always use the ring.
+ * Returns 0 on success and -1 for an unknown name
+ */
+int setStreamIo (const char* name, int depth) {
+    if (strcmp(name, "auto") == 0) {
+        ioPath = IO_AUTO;
+    } else if (strcmp(name, "mmap") == 0) {
+        ioPath = IO_MMAP;
+    } else if (strcmp(name, "ring") == 0) {
+        ioPath = IO_RING;
+    } else if (strcmp(name, "uring") == 0) {
+        ioPath = IO_URING;
+    } else {
+        return -1;
+    }
+    if (depth > 0) {
+        ioDepth = depth;
+    }
+    return 0;
+}
+
+static unsigned long long padLines (unsigned long long bytes) {
+    return (bytes + MAX_WIDTH - 1) / MAX_WIDTH * MAX_WIDTH;
+}
+
+// Writes all of data, returns 0 on success
+static int writeAll (int fd, const unsigned char* data, size_t bytes) {
+    while (bytes > 0) {
+        ssize_t n = write(fd, data, bytes);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        bytes -= n;
+    }
+    return 0;
+}
+
+// Reads up to bytes, short only at the end of the file, -1 on an error
+static ssize_t readAll (int fd, unsigned char* data, size_t bytes) {
+    size_t got = 0;
+    while (got < bytes) {
+        ssize_t n = read(fd, data + got, bytes - got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        got += n;
+    }
+    return got;
+}
+
+/**
+ * Maps size bytes of in and the padded output a window at a time
+ * Returns the bytes written, -1 on failure, STREAM_UNSUPPORTED when the
+ * first window could not be mapped and nothing was done
+ */
+static long long streamMapped (int in, int out, unsigned long long size, StreamBody body, void* ctx) {
+    unsigned long long padded = padLines(size);
+    // the pad of the last line reads as zeros
+    if (ftruncate(out, padded) != 0) {
+        return STREAM_UNSUPPORTED;
+    }
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+    for (unsigned long long offset = 0; offset < padded; offset += IO_WINDOW) {
+        size_t bytes = padded - offset < IO_WINDOW ? padded - offset : IO_WINDOW;
+        size_t have = size - offset < bytes ? size - offset : bytes;
+        // start reading the next window while this one is transformed
+        if (offset + IO_WINDOW < size) {
+            posix_fadvise(in, offset + IO_WINDOW, IO_WINDOW, POSIX_FADV_WILLNEED);
+        }
+        void* src = mmap(NULL, have, PROT_READ, MAP_PRIVATE, in, offset);
+        void* dst = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, out, offset);
+        if (src == MAP_FAILED || dst == MAP_FAILED) {
+            if (src != MAP_FAILED) {
+                munmap(src, have);
+            }
+            if (dst != MAP_FAILED) {
+                munmap(dst, bytes);
+            }
+            return offset == 0 ? STREAM_UNSUPPORTED : -1;
+        }
+        memcpy(dst, src, have);
+        munmap(src, have);
+
+        int failed = body(ctx, (unsigned char*)dst, bytes / MAX_WIDTH, offset / MAX_WIDTH);
+        // start the write-back now, the pages leave the process with the map
+        msync(dst, bytes, MS_ASYNC);
+        munmap(dst, bytes);
+        if (failed != 0) {
+            return -1;
+        }
+    }
+    return padded;
+}
+
+static void* readerMain (void* arg) {
+    Ring* ring = (Ring*)arg;
+    for (int n = 0;; n++) {
+        pthread_mutex_lock(&ring->lock);
+        while (n - ring->consumed >= RING_BUFFERS && !ring->stopping) {
+            pthread_cond_wait(&ring->changed, &ring->lock);
+        }
+        bool stopping = ring->stopping;
+        pthread_mutex_unlock(&ring->lock);
+        if (stopping) {
+            break;
+        }
+
+        int b = n % RING_BUFFERS;
+        size_t want = ring->left < IO_WINDOW ? ring->left : IO_WINDOW;
+        ssize_t got = readAll(ring->in, ring->buffer[b], want);
+
+        pthread_mutex_lock(&ring->lock);
+        ring->failed = got < 0;
+        ring->length[b] = got < 0 ? 0 : got;
+        ring->left -= ring->length[b];
+        ring->filled = n + 1;
+        pthread_cond_broadcast(&ring->changed);
+        pthread_mutex_unlock(&ring->lock);
+        // a short buffer is the last one
+        if (got < IO_WINDOW) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Reads in through the ring and writes to out
+ * Returns the bytes written, -1 on failure
+ */
+static long long streamRing (int in, int out, unsigned long long size, StreamBody body, void* ctx) {
+    Ring ring;
+    memset(&ring, 0, sizeof(ring));
+    ring.in = in;
+    ring.left = size;
+    pthread_mutex_init(&ring.lock, NULL);
+    pthread_cond_init(&ring.changed, NULL);
+    bool ok = true;
+    for (int b = 0; b < RING_BUFFERS; b++) {
+        ring.buffer[b] = arenaAlloc(IO_WINDOW);
+        ok = ok && ring.buffer[b] != NULL;
+    }
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+    pthread_t reader;
+    bool reading = ok && pthread_create(&reader, NULL, readerMain, &ring) == 0;
+    ok = reading;
+
+    long long written = 0;
+    for (int n = 0; ok; n++) {
+        pthread_mutex_lock(&ring.lock);
+        while (ring.filled <= n) {
+            pthread_cond_wait(&ring.changed, &ring.lock);
+        }
+        int b = n % RING_BUFFERS;
+        size_t bytes = ring.length[b];
+        ok = !ring.failed;
+        pthread_mutex_unlock(&ring.lock);
+        if (!ok || bytes == 0) {
+            break;
+        }
+
+        size_t padded = padLines(bytes);
+        memset(ring.buffer[b] + bytes, 0, padded - bytes);
+        ok = body(ctx, ring.buffer[b], padded / MAX_WIDTH, written / MAX_WIDTH) == 0 &&
+             writeAll(out, ring.buffer[b], padded) == 0;
+        written += padded;
+
+        pthread_mutex_lock(&ring.lock);
+        ring.consumed = n + 1;
+        pthread_cond_broadcast(&ring.changed);
+        pthread_mutex_unlock(&ring.lock);
+        if (bytes < IO_WINDOW) {
+            break;
+        }
+    }
+
+    if (reading) {
+        pthread_mutex_lock(&ring.lock);
+        ring.stopping = true;
+        pthread_cond_broadcast(&ring.changed);
+        pthread_mutex_unlock(&ring.lock);
+        pthread_join(reader, NULL);
+    }
+    for (int b = 0; b < RING_BUFFERS; b++) {
+        arenaFree(ring.buffer[b], IO_WINDOW);
+    }
+    pthread_mutex_destroy(&ring.lock);
+    pthread_cond_destroy(&ring.changed);
+    return ok ? written : -1;
+}
+
+/**
+ * Transforms the first limit bytes of inName (all of it for 0) into
+ * outName, body runs over every window in order. "-" stands for stdin or
+ * stdout, which always go through the ring.
+ * Returns the bytes written, -1 on failure
+ */
+long long streamFile (const char* inName, const char* outName, unsigned long long limit, StreamBody body, void* ctx) {
+    bool stdIn = strcmp(inName, "-") == 0;
+    bool stdOut = strcmp(outName, "-") == 0;
+    int in = stdIn ? STDIN_FILENO : open(inName, O_RDONLY);
+    if (in < 0) {
+        return -1;
+    }
+    int out = stdOut ? STDOUT_FILENO : open(outName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        if (!stdIn) {
+            close(in);
+        }
+        return -1;
+    }
+
+    struct stat inStat, outStat;
+    bool regular = !stdOut && fstat(in, &inStat) == 0 && fstat(out, &outStat) == 0 &&
+                   S_ISREG(inStat.st_mode) && S_ISREG(outStat.st_mode);
+    unsigned long long size = regular ? inStat.st_size : ~0ULL;
+    if (limit > 0 && limit < size) {
+        size = limit;
+    }
+    // every path that cannot run hands over to the next one untouched
+    long long written = STREAM_UNSUPPORTED;
+    if (regular && (ioPath == IO_AUTO || ioPath == IO_URING)) {
+        written = uringStream(in, out, size, ioDepth, body, ctx);
+    }
+    if (regular && ioPath != IO_RING && written == STREAM_UNSUPPORTED) {
+        written = streamMapped(in, out, size, body, ctx);
+    }
+    if (written == STREAM_UNSUPPORTED) {
+        written = (regular ? ftruncate(out, 0) : 0) == 0 ? streamRing(in, out, size, body, ctx) : -1;
+    }
+
+    if (!stdIn) {
+        close(in);
+    }
+    if (!stdOut && close(out) != 0) {
+        written = -1;
+    }
+    return written;
+}
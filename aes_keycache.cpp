@@ -0,0 +1,249 @@
+/**
+ *  Expanded-key cache
+ *  Keeps the encryption and decryption schedules of recently used keys, so
+ *  a service that sees the same keys again skips keyExpansion(). The
+ *  cache is set-associative: a hash of the raw key picks a set of
+ *  KEY_CACHE_WAYS slots and the least recently used slot of the set is
+ *  evicted. The slots live in one cache-line aligned arena block taken by
+ *  keyCacheStart(), so the memory is fixed.
+ *
+ *  Lookups take no locks. Every slot carries a sequence number that a
+ *  writer makes odd while it changes the slot, a reader copies the
+ *  schedules out and retries if the number moved. The slot contents are
+ *  words read and written with relaxed atomics, so a reader racing a
+ *  writer sees torn data it throws away, never undefined behaviour.
+ *  Writers of a set serialize on a spin lock of that set. Each set has a
+ *  clock that only its misses advance, and a hit stamps its slot with it
+ *  when the stamp is older, so hits on a hot key leave its slot and all
+ *  shared state unwritten. The stamp is taken outside the lock and may
+ *  land on a key that just replaced the one read, so the LRU order is
+ *  approximate: the cost is at worst an early eviction. Evicted keys and
+ *  schedules are wiped before the slot is reused, and all of them on
+ *  keyCacheStop().
+ */
+#include "aes.h"
+
+#define MAX_WIDTH 16
+#define MAX_KEY_BYTES 32
+#define KEY_CACHE_WAYS 8
+#define CACHE_LINE 64
+// the slot contents in 8-byte words
+#define KEY_WORDS (MAX_KEY_BYTES / 8)
+#define SCHEDULE_WORDS (MAX_KEY_SCHEDULE / 8)
+
+struct KeySlot {
+    unsigned seq;                       // odd while a writer changes the slot
+    int bits;                           // key size, 0 for an empty slot
+    unsigned long long hash;
+    unsigned long long used;            // set clock of the last hit
+    unsigned long long raw[KEY_WORDS];  // the key, zero padded
+    unsigned long long enc[SCHEDULE_WORDS];
+    unsigned long long dec[SCHEDULE_WORDS];
+} __attribute__((aligned(CACHE_LINE)));
+
+struct KeySet {
+    unsigned long long clock;               // misses of the set so far
+    volatile int lock;
+    char pad[CACHE_LINE - sizeof(unsigned long long) - sizeof(int)];   // keep the locks on separate lines
+};
+
+static KeySlot* slots = NULL;
+static KeySet* sets = NULL;
+static unsigned numSets = 0;
+
+// FNV-1a of the key and its size, the raw key is compared as well
+static unsigned long long keyHash (const unsigned char* raw, int bytes) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (int i = 0; i < bytes; i++) {
+        h = (h ^ raw[i]) * 1099511628211ULL;
+    }
+    return (h ^ bytes) * 1099511628211ULL;
+}
+
+// memset that the compiler may not drop for memory about to be reused
+static void wipe (void* p, size_t n) {
+    volatile unsigned char* v = (volatile unsigned char*)p;
+    while (n--) {
+        *v++ = 0;
+    }
+}
+
+// Stores words of src into a slot, zeros for a NULL src
+static void storeWords (unsigned long long* dst, const unsigned long long* src, int words) {
+    for (int i = 0; i < words; i++) {
+        __atomic_store_n(&dst[i], src ? src[i] : 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Copies words of a slot out to bytes that need not be aligned
+static void loadWords (unsigned char* dst, const unsigned long long* src, int words) {
+    for (int i = 0; i < words; i++) {
+        unsigned long long w = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+        memcpy(dst + 8 * i, &w, 8);
+    }
+}
+
+static bool sameKey (const KeySlot* slot, const unsigned long long* raw, int bits, unsigned long long hash) {
+    if (__atomic_load_n(&slot->bits, __ATOMIC_RELAXED) != bits ||
+        __atomic_load_n(&slot->hash, __ATOMIC_RELAXED) != hash) {
+        return false;
+    }
+    for (int i = 0; i < KEY_WORDS; i++) {
+        if (__atomic_load_n(&slot->raw[i], __ATOMIC_RELAXED) != raw[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Set up the cache for at least entries keys, rounded up to whole sets of
+ * a power of two. The cache must not be in use by other threads.
+ * Returns 0 on success
+ */
+int keyCacheStart (int entries) {
+    keyCacheStop();
+    unsigned n = 1;
+    while (n * KEY_CACHE_WAYS < (unsigned)entries) {
+        n <<= 1;
+    }
+    unsigned char* s = arenaAlloc((size_t)n * KEY_CACHE_WAYS * sizeof(KeySlot));
+    unsigned char* l = arenaAlloc((size_t)n * sizeof(KeySet));
+    if (s == NULL || l == NULL) {
+        arenaFree(s, (size_t)n * KEY_CACHE_WAYS * sizeof(KeySlot));
+        arenaFree(l, (size_t)n * sizeof(KeySet));
+        return -1;
+    }
+    memset(s, 0, (size_t)n * KEY_CACHE_WAYS * sizeof(KeySlot));
+    memset(l, 0, (size_t)n * sizeof(KeySet));
+    slots = (KeySlot*)s;
+    sets = (KeySet*)l;
+    numSets = n;
+    return 0;
+}
+
+// Wipe and release the cache, the same rule as keyCacheStart() applies
+void keyCacheStop () {
+    if (slots == NULL) {
+        return;
+    }
+    wipe(slots, (size_t)numSets * KEY_CACHE_WAYS * sizeof(KeySlot));
+    arenaFree(slots, (size_t)numSets * KEY_CACHE_WAYS * sizeof(KeySlot));
+    arenaFree(sets, (size_t)numSets * sizeof(KeySet));
+    slots = NULL;
+    sets = NULL;
+    numSets = 0;
+}
+
+/**
+ * Copy the schedules of a matching slot out, consistent under concurrent
+ * writers. Returns true on a match
+ */
+static bool readSlot (KeySlot* slot, const unsigned long long* raw, int bits, unsigned long long hash,
+                      unsigned char* enc, unsigned char* dec) {
+    int words = MAX_WIDTH * (rounds + 1) / 8;
+    for (;;) {
+        unsigned seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        bool match = sameKey(slot, raw, bits, hash);
+        if (match) {
+            if (enc) {
+                loadWords(enc, slot->enc, words);
+            }
+            if (dec) {
+                loadWords(dec, slot->dec, words);
+            }
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+            return match;
+        }
+    }
+}
+
+/**
+ * The schedules of inputKey at the current key size: keyExpansion() into
+ * expansionKeys and keyExpansionInv() into decKeys, either may be NULL.
+ * Without keyCacheStart() every call expands the key.
+ * Returns 1 on a hit and 0 when the key was expanded
+ */
+int cachedKeyExpansion (const unsigned char* inputKey, unsigned char* expansionKeys, unsigned char* decKeys) {
+    int bits = (rounds - 6) * 32;
+    int bytes = bits / 8;
+    if (slots == NULL) {
+        if (expansionKeys) {
+            keyExpansion((unsigned char*)inputKey, expansionKeys);
+        }
+        if (decKeys) {
+            keyExpansionInv((unsigned char*)inputKey, decKeys);
+        }
+        return 0;
+    }
+    unsigned long long raw[KEY_WORDS] = {0};
+    memcpy(raw, inputKey, bytes);
+    unsigned long long hash = keyHash(inputKey, bytes);
+    unsigned set = (unsigned)(hash >> 32) & (numSets - 1);
+    KeySlot* ways = &slots[(size_t)set * KEY_CACHE_WAYS];
+    for (int w = 0; w < KEY_CACHE_WAYS; w++) {
+        if (readSlot(&ways[w], raw, bits, hash, expansionKeys, decKeys)) {
+            unsigned long long now = __atomic_load_n(&sets[set].clock, __ATOMIC_RELAXED);
+            if (__atomic_load_n(&ways[w].used, __ATOMIC_RELAXED) != now) {
+                __atomic_store_n(&ways[w].used, now, __ATOMIC_RELAXED);
+            }
+            wipe(raw, sizeof(raw));
+            return 1;
+        }
+    }
+
+    // expand outside the lock, both schedules so the next caller hits
+    unsigned long long enc[SCHEDULE_WORDS] = {0};
+    unsigned long long dec[SCHEDULE_WORDS] = {0};
+    keyExpansion((unsigned char*)inputKey, (unsigned char*)enc);
+    keyExpansionInv((unsigned char*)inputKey, (unsigned char*)dec);
+    int scheduleBytes = MAX_WIDTH * (rounds + 1);
+    if (expansionKeys) {
+        memcpy(expansionKeys, enc, scheduleBytes);
+    }
+    if (decKeys) {
+        memcpy(decKeys, dec, scheduleBytes);
+    }
+
+    while (__sync_lock_test_and_set(&sets[set].lock, 1)) {
+    }
+    // another writer may have stored the key meanwhile, else take an empty
+    // slot or the least recently used one
+    KeySlot* victim = NULL;
+    for (int w = 0; w < KEY_CACHE_WAYS; w++) {
+        KeySlot* slot = &ways[w];
+        if (sameKey(slot, raw, bits, hash)) {
+            victim = NULL;
+            break;
+        }
+        if (victim == NULL || (victim->bits != 0 && (slot->bits == 0 ||
+            __atomic_load_n(&slot->used, __ATOMIC_RELAXED) < __atomic_load_n(&victim->used, __ATOMIC_RELAXED)))) {
+            victim = slot;
+        }
+    }
+    if (victim) {
+        // only writers holding the set lock change seq
+        unsigned seq = victim->seq;
+        __atomic_store_n(&victim->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&victim->bits, bits, __ATOMIC_RELAXED);
+        __atomic_store_n(&victim->hash, hash, __ATOMIC_RELAXED);
+        storeWords(victim->raw, raw, KEY_WORDS);
+        storeWords(victim->enc, enc, SCHEDULE_WORDS);
+        storeWords(victim->dec, dec, SCHEDULE_WORDS);
+        unsigned long long now = sets[set].clock + 1;
+        __atomic_store_n(&sets[set].clock, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&victim->used, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&victim->seq, seq + 2, __ATOMIC_RELEASE);
+    }
+    __sync_lock_release(&sets[set].lock);
+    wipe(raw, sizeof(raw));
+    wipe(enc, sizeof(enc));
+    wipe(dec, sizeof(dec));
+    return 0;
+}
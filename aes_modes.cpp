@@ -0,0 +1,442 @@
+/**
+ *  Block cipher modes built on top of encrypt()/decryptInv()
+ *
+ *  CTR: counter block i is iv + i taken as one 128-bit big-endian number
+ *  (NIST SP 800-38A), so any block can be reached directly from the iv.
+ *
+ *  CBC: decryption only needs the previous ciphertext line, so it runs in
+ *  parallel like ECB. Encryption is serial within a stream; several streams
+ *  are interleaved instead so one encrypt() call still fills the pipeline.
+ *
+ *  XTS (IEEE 1619): data unit n starts from tweak E(K2, n) and block j of the
+ *  unit uses that tweak times x^j in GF(2^128). Units are independent, so
+ *  they are spread over the worker pool. A unit that is not a whole number
+ *  of lines ends with ciphertext stealing.
+ *
+ *  Source cited: https://nvlpubs.nist.gov/nistpubs/Legacy/SP/nistspecialpublication800-38a.pdf
+ */
+#include "aes.h"
+
+#define MAX_WIDTH 16
+// keystream blocks produced per encrypt() call
+#define CTR_BATCH 64
+// lines handed to a worker at a time
+#define CHUNK_LINES 2048
+// lines decrypted per decryptInv() call in CBC
+#define CBC_BATCH 64
+// most CBC streams interleaved in one encrypt() call
+#define MAX_STREAMS 16
+// XTS lines per encrypt() call, also the number of tweaks built at once,
+// a multiple of 4
+#define XTS_BATCH 32
+
+static unsigned long long loadBE64 (const unsigned char* p) {
+    unsigned long long x = 0;
+    for (int i = 0; i < 8; i++) {
+        x = (x << 8) | p[i];
+    }
+    return x;
+}
+
+static void storeBE64 (unsigned char* p, unsigned long long x) {
+    for (int i = 7; i >= 0; i--) {
+        p[i] = (unsigned char)x;
+        x >>= 8;
+    }
+}
+
+/**
+ * Seek: the counter block for block index "block" of the stream
+ */
+void ctrCounter (const unsigned char* iv, unsigned long long block, unsigned char* counter) {
+    unsigned long long hi = loadBE64(iv);
+    unsigned long long lo = loadBE64(iv + 8);
+    unsigned long long sum = lo + block;
+    if (sum < lo) {
+        hi++;
+    }
+    storeBE64(counter, hi);
+    storeBE64(counter + 8, sum);
+}
+
+/**
+ * Encrypt or decrypt lines of data in place, data[0] being block "block"
+ * of the stream started at iv
+ */
+void ctrXcrypt (int lines, unsigned char* data, unsigned char* key, const unsigned char* iv, unsigned long long block) {
+    unsigned char ks[MAX_WIDTH * CTR_BATCH];
+    unsigned char counter[MAX_WIDTH];
+    ctrCounter(iv, block, counter);
+    unsigned long long hi = loadBE64(counter);
+    unsigned long long lo = loadBE64(counter + 8);
+
+    for (int i = 0; i < lines; i += CTR_BATCH) {
+        int n = lines - i < CTR_BATCH ? lines - i : CTR_BATCH;
+        for (int j = 0; j < n; j++) {
+            storeBE64(ks + MAX_WIDTH * j, hi);
+            storeBE64(ks + MAX_WIDTH * j + 8, lo);
+            if (++lo == 0) {
+                hi++;
+            }
+        }
+        encrypt(n, ks, key);
+        unsigned char* p = data + i * MAX_WIDTH;
+        for (int j = 0; j < n * MAX_WIDTH; j++) {
+            p[j] ^= ks[j];
+        }
+    }
+}
+
+struct CtrJob {
+    unsigned char* data;
+    unsigned char* key;
+    const unsigned char* iv;
+    unsigned long long block;
+};
+
+static void ctrChunk (void* ctx, int begin, int end) {
+    CtrJob* job = (CtrJob*)ctx;
+    ctrXcrypt(end - begin, job->data + begin * MAX_WIDTH, job->key, job->iv, job->block + begin);
+}
+
+void parallelCtr (int lines, unsigned char* data, unsigned char* key, const unsigned char* iv, unsigned long long block) {
+    CtrJob job = {data, key, iv, block};
+    poolFor(lines, CHUNK_LINES, ctrChunk, &job);
+}
+
+static void xorLine (unsigned char* dst, const unsigned char* src) {
+    for (int i = 0; i < MAX_WIDTH; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+/**
+ * CBC encryption of one stream, iv is replaced by the last ciphertext line
+ * so a stream can be continued by the next call
+ */
+void cbcEncrypt (int lines, unsigned char* data, unsigned char* key, unsigned char* iv) {
+    unsigned char* prev = iv;
+    for (int i = 0; i < lines; i++) {
+        unsigned char* line = data + i * MAX_WIDTH;
+        xorLine(line, prev);
+        encrypt(1, line, key);
+        prev = line;
+    }
+    if (lines > 0) {
+        memcpy(iv, prev, MAX_WIDTH);
+    }
+}
+
+/**
+ * CBC encryption of independent streams, one line of each stream per step
+ * Every step hands up to MAX_STREAMS independent lines to encrypt(), which
+ * keeps the AES-NI and bitslice pipelines full.
+ */
+void cbcEncryptStreams (int streams, const int* lines, unsigned char** data, unsigned char* key, unsigned char** iv) {
+    for (int first = 0; first < streams; first += MAX_STREAMS) {
+        int count = streams - first < MAX_STREAMS ? streams - first : MAX_STREAMS;
+        unsigned char batch[MAX_WIDTH * MAX_STREAMS];
+        int slot[MAX_STREAMS];
+        int longest = 0;
+        for (int s = 0; s < count; s++) {
+            if (lines[first + s] > longest) {
+                longest = lines[first + s];
+            }
+        }
+        for (int i = 0; i < longest; i++) {
+            int n = 0;
+            for (int s = 0; s < count; s++) {
+                if (i < lines[first + s]) {
+                    unsigned char* prev = i == 0 ? iv[first + s] : data[first + s] + (i - 1) * MAX_WIDTH;
+                    memcpy(batch + n * MAX_WIDTH, data[first + s] + i * MAX_WIDTH, MAX_WIDTH);
+                    xorLine(batch + n * MAX_WIDTH, prev);
+                    slot[n++] = s;
+                }
+            }
+            encrypt(n, batch, key);
+            for (int j = 0; j < n; j++) {
+                memcpy(data[first + slot[j]] + i * MAX_WIDTH, batch + j * MAX_WIDTH, MAX_WIDTH);
+            }
+        }
+        for (int s = 0; s < count; s++) {
+            if (lines[first + s] > 0) {
+                memcpy(iv[first + s], data[first + s] + (lines[first + s] - 1) * MAX_WIDTH, MAX_WIDTH);
+            }
+        }
+    }
+}
+
+/**
+ * CBC decryption in place with a keyExpansionInv() schedule
+ * prev is the ciphertext line before data[0] (the iv for the first line)
+ */
+static void cbcDecryptRange (int lines, unsigned char* data, unsigned char* decKey, const unsigned char* prev) {
+    unsigned char saved[MAX_WIDTH * (CBC_BATCH + 1)];
+    memcpy(saved, prev, MAX_WIDTH);
+    for (int i = 0; i < lines; i += CBC_BATCH) {
+        int n = lines - i < CBC_BATCH ? lines - i : CBC_BATCH;
+        unsigned char* p = data + i * MAX_WIDTH;
+        // saved[0] is the line before the batch, saved[1..n] the batch itself
+        memcpy(saved + MAX_WIDTH, p, n * MAX_WIDTH);
+        decryptInv(n, p, decKey);
+        for (int j = 0; j < n; j++) {
+            xorLine(p + j * MAX_WIDTH, saved + j * MAX_WIDTH);
+        }
+        memcpy(saved, saved + n * MAX_WIDTH, MAX_WIDTH);
+    }
+}
+
+/**
+ * iv is replaced by the last ciphertext line, as in cbcEncrypt()
+ */
+void cbcDecrypt (int lines, unsigned char* data, unsigned char* decKey, unsigned char* iv) {
+    unsigned char last[MAX_WIDTH];
+    if (lines <= 0) {
+        return;
+    }
+    memcpy(last, data + (lines - 1) * MAX_WIDTH, MAX_WIDTH);
+    cbcDecryptRange(lines, data, decKey, iv);
+    memcpy(iv, last, MAX_WIDTH);
+}
+
+struct CbcJob {
+    unsigned char* data;
+    unsigned char* decKey;
+    unsigned char* bounds;  // ciphertext line before every chunk
+};
+
+static void cbcChunk (void* ctx, int begin, int end) {
+    CbcJob* job = (CbcJob*)ctx;
+    cbcDecryptRange(end - begin, job->data + begin * MAX_WIDTH, job->decKey,
+                    job->bounds + (begin / CHUNK_LINES) * MAX_WIDTH);
+}
+
+/**
+ * Chunks are decrypted in place by different workers, so the ciphertext
+ * line in front of every chunk is saved before any worker starts
+ */
+void parallelCbcDecrypt (int lines, unsigned char* data, unsigned char* decKey, unsigned char* iv) {
+    if (lines <= 0) {
+        return;
+    }
+    int chunks = (lines + CHUNK_LINES - 1) / CHUNK_LINES;
+    unsigned char* bounds = arenaAlloc((size_t)chunks * MAX_WIDTH);
+    unsigned char last[MAX_WIDTH];
+    memcpy(bounds, iv, MAX_WIDTH);
+    for (int c = 1; c < chunks; c++) {
+        memcpy(bounds + c * MAX_WIDTH, data + ((size_t)c * CHUNK_LINES - 1) * MAX_WIDTH, MAX_WIDTH);
+    }
+    memcpy(last, data + (lines - 1) * MAX_WIDTH, MAX_WIDTH);
+
+    CbcJob job = {data, decKey, bounds};
+    poolFor(lines, CHUNK_LINES, cbcChunk, &job);
+
+    memcpy(iv, last, MAX_WIDTH);
+    arenaFree(bounds, (size_t)chunks * MAX_WIDTH);
+}
+
+static void storeLE64 (unsigned char* p, unsigned long long x) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (unsigned char)x;
+        x >>= 8;
+    }
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+/**
+ * Tweak times x^k for k from 1 to 8. The tweak is a little-endian 128-bit
+ * number, so it loads as is: both 64-bit halves shift at once, the bits
+ * out of the low half move into the high one and those out of the top
+ * come back in times x^7 + x^2 + x + 1
+ */
+static inline __m128i xtsTimes (__m128i t, int k) {
+    __m128i top = _mm_srli_epi64(t, 64 - k);
+    __m128i r = _mm_srli_si128(top, 8);
+    r = _mm_xor_si128(_mm_xor_si128(r, _mm_slli_epi64(r, 1)), _mm_xor_si128(_mm_slli_epi64(r, 2), _mm_slli_epi64(r, 7)));
+    return _mm_xor_si128(_mm_xor_si128(_mm_slli_epi64(t, k), _mm_slli_si128(top, 8)), r);
+}
+
+// The tweaks of the next four lines, a step takes all four times x^4
+struct XtsChain {
+    __m128i t[4];
+};
+
+static void xtsSeed (XtsChain* c, const unsigned char* tweak) {
+    c->t[0] = _mm_loadu_si128((const __m128i*)tweak);
+    for (int k = 1; k < 4; k++) {
+        c->t[k] = xtsTimes(c->t[k - 1], 1);
+    }
+}
+
+/**
+ * The next n tweaks of the chain into tw, n at most XTS_BATCH
+ */
+static void xtsTweaks (XtsChain* c, unsigned char* tw, int n) {
+    for (int j = 0; j < n; j += 4) {
+        for (int k = 0; k < 4; k++) {
+            _mm_storeu_si128((__m128i*)(tw + MAX_WIDTH * (j + k)), c->t[k]);
+            c->t[k] = xtsTimes(c->t[k], 4);
+        }
+    }
+    if (n % 4 != 0) {
+        // the chain ran past line n, whose tweak is in tw already
+        xtsSeed(c, tw + MAX_WIDTH * n);
+    }
+}
+
+#else
+
+static unsigned long long loadLE64 (const unsigned char* p) {
+    unsigned long long x = 0;
+    for (int i = 7; i >= 0; i--) {
+        x = (x << 8) | p[i];
+    }
+    return x;
+}
+
+// The tweak of the next line in two 64-bit halves
+struct XtsChain {
+    unsigned long long lo, hi;
+};
+
+static void xtsSeed (XtsChain* c, const unsigned char* tweak) {
+    c->lo = loadLE64(tweak);
+    c->hi = loadLE64(tweak + 8);
+}
+
+static void xtsTweaks (XtsChain* c, unsigned char* tw, int n) {
+    for (int j = 0; j < n; j++) {
+        storeLE64(tw + MAX_WIDTH * j, c->lo);
+        storeLE64(tw + MAX_WIDTH * j + 8, c->hi);
+        unsigned long long carry = c->hi >> 63;
+        c->hi = (c->hi << 1) | (c->lo >> 63);
+        c->lo = (c->lo << 1) ^ (carry * 0x87);
+    }
+}
+
+#endif
+
+struct XtsJob {
+    unsigned char* data;
+    size_t len;
+    int unit;
+    unsigned char* key;      // data key, keyExpansionInv() schedule when decrypting
+    unsigned char* tweakKey;
+    unsigned long long first;
+    bool decrypting;
+};
+
+static void xtsBlock (const XtsJob* job, unsigned char* line, const unsigned char* t) {
+    xorLine(line, t);
+    if (job->decrypting) {
+        decryptInv(1, line, job->key);
+    } else {
+        encrypt(1, line, job->key);
+    }
+    xorLine(line, t);
+}
+
+/**
+ * One data unit of len bytes (at least one line), tweak0 = E(K2, unit number)
+ */
+static void xtsUnit (const XtsJob* job, unsigned char* p, size_t len, const unsigned char* tweak0) {
+    unsigned char tw[MAX_WIDTH * XTS_BATCH];
+    XtsChain chain;
+    xtsSeed(&chain, tweak0);
+    size_t lines = len / MAX_WIDTH;
+    int tail = (int)(len % MAX_WIDTH);
+    // with a partial last line the last whole line is left for stealing
+    size_t plain = tail ? lines - 1 : lines;
+
+    for (size_t i = 0; i < plain; i += XTS_BATCH) {
+        int n = plain - i < XTS_BATCH ? (int)(plain - i) : XTS_BATCH;
+        unsigned char* q = p + i * MAX_WIDTH;
+        xtsTweaks(&chain, tw, n);
+        for (int j = 0; j < n * MAX_WIDTH; j++) {
+            q[j] ^= tw[j];
+        }
+        if (job->decrypting) {
+            decryptInv(n, q, job->key);
+        } else {
+            encrypt(n, q, job->key);
+        }
+        for (int j = 0; j < n * MAX_WIDTH; j++) {
+            q[j] ^= tw[j];
+        }
+    }
+    if (!tail) {
+        return;
+    }
+
+    // ciphertext stealing over the last whole line and the partial one
+    unsigned char* last = p + plain * MAX_WIDTH;
+    unsigned char* part = last + MAX_WIDTH;
+    xtsTweaks(&chain, tw, 2);
+    if (job->decrypting) {
+        // the last whole line was produced with the later tweak
+        xtsBlock(job, last, tw + MAX_WIDTH);
+    } else {
+        xtsBlock(job, last, tw);
+    }
+    for (int i = 0; i < tail; i++) {
+        unsigned char c = part[i];
+        part[i] = last[i];
+        last[i] = c;
+    }
+    if (job->decrypting) {
+        xtsBlock(job, last, tw);
+    } else {
+        xtsBlock(job, last, tw + MAX_WIDTH);
+    }
+}
+
+static void xtsChunk (void* ctx, int begin, int end) {
+    XtsJob* job = (XtsJob*)ctx;
+    unsigned char tweaks[MAX_WIDTH * XTS_BATCH];
+    for (int u = begin; u < end; u += XTS_BATCH) {
+        int n = end - u < XTS_BATCH ? end - u : XTS_BATCH;
+        // the starting tweaks of n units in one encrypt() call
+        for (int j = 0; j < n; j++) {
+            storeLE64(tweaks + MAX_WIDTH * j, job->first + u + j);
+            storeLE64(tweaks + MAX_WIDTH * j + 8, 0);
+        }
+        encrypt(n, tweaks, job->tweakKey);
+        for (int j = 0; j < n; j++) {
+            size_t off = (size_t)(u + j) * job->unit;
+            size_t len = job->len - off < (size_t)job->unit ? job->len - off : (size_t)job->unit;
+            xtsUnit(job, job->data + off, len, tweaks + MAX_WIDTH * j);
+        }
+    }
+}
+
+static int xtsCrypt (XtsJob* job) {
+    if (job->unit < MAX_WIDTH || (job->len % job->unit != 0 && job->len % job->unit < MAX_WIDTH)) {
+        return -1;
+    }
+    int units = (int)((job->len + job->unit - 1) / job->unit);
+    int grain = CHUNK_LINES * MAX_WIDTH / job->unit;
+    poolFor(units, grain > 0 ? grain : 1, xtsChunk, job);
+    return 0;
+}
+
+/**
+ * XTS in place over data units of unit bytes (512 or 4096 for disks),
+ * data[0] starting unit number "unit0"
+ * key and tweakKey are keyExpansion() schedules of the two halves of the
+ * XTS key. The last unit may be shorter but not below one line.
+ * Returns 0 on success, -1 on a bad length
+ */
+int xtsEncrypt (unsigned char* data, size_t len, int unit, unsigned char* key, unsigned char* tweakKey, unsigned long long unit0) {
+    XtsJob job = {data, len, unit, key, tweakKey, unit0, false};
+    return xtsCrypt(&job);
+}
+
+/**
+ * As xtsEncrypt() with decKey from keyExpansionInv() for the data key
+ */
+int xtsDecrypt (unsigned char* data, size_t len, int unit, unsigned char* decKey, unsigned char* tweakKey, unsigned long long unit0) {
+    XtsJob job = {data, len, unit, decKey, tweakKey, unit0, true};
+    return xtsCrypt(&job);
+}
@@ -0,0 +1,244 @@
+/**
+ *  AES-NI backend for encrypt() and decrypt()
+ *  Eight independent lines are kept in flight per iteration so that the
+ *  AESENC/AESDEC latency is hidden behind the other seven blocks.
+ *
+ *  On targets without the instructions (e.g. the ARM host of the board)
+ *  aesniSupported() returns 0 and the engine is never selected.
+ */
+#include "aes.h"
+
+#define MAX_WIDTH 16
+// number of lines in flight per iteration
+#define PIPELINE 8
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+#define AESNI __attribute__((target("aes,sse2")))
+
+/**
+ * Check CPUID leaf 1 for the AES-NI feature bit
+ */
+int aesniSupported () {
+    unsigned int a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d)) {
+        return 0;
+    }
+    return (c & bit_AES) != 0;
+}
+
+AESNI static void loadKeys (unsigned char* key, __m128i* rk, int nr) {
+    for (int i = 0; i <= nr; i++) {
+        rk[i] = _mm_loadu_si128((__m128i*)(key + MAX_WIDTH * i));
+    }
+}
+
+/**
+ * Rounds I to Nr on N blocks, unrolled by recursion on I
+ * Decryption counts down: round I uses round key Nr - I.
+ */
+template <int N, int I, int Nr> struct AesniRounds {
+    AESNI static inline void encrypt (__m128i* b, const __m128i* rk) {
+        for (int j = 0; j < N; j++) {
+            b[j] = _mm_aesenc_si128(b[j], rk[I]);
+        }
+        AesniRounds<N, I + 1, Nr>::encrypt(b, rk);
+    }
+
+    AESNI static inline void decrypt (__m128i* b, const __m128i* rk) {
+        for (int j = 0; j < N; j++) {
+            b[j] = _mm_aesdec_si128(b[j], rk[Nr - I]);
+        }
+        AesniRounds<N, I + 1, Nr>::decrypt(b, rk);
+    }
+};
+
+template <int N, int Nr> struct AesniRounds<N, Nr, Nr> {
+    AESNI static inline void encrypt (__m128i* b, const __m128i* rk) {
+        for (int j = 0; j < N; j++) {
+            b[j] = _mm_aesenclast_si128(b[j], rk[Nr]);
+        }
+    }
+
+    AESNI static inline void decrypt (__m128i* b, const __m128i* rk) {
+        for (int j = 0; j < N; j++) {
+            b[j] = _mm_aesdeclast_si128(b[j], rk[0]);
+        }
+    }
+};
+
+template <int Nr> AESNI static void encryptLines (int lines, unsigned char* state, unsigned char* key) {
+    __m128i rk[Nr + 1];
+    __m128i b[PIPELINE];
+    loadKeys(key, rk, Nr);
+
+    int i = 0;
+    for (; i + PIPELINE <= lines; i += PIPELINE) {
+        __m128i* p = (__m128i*)(state + i * MAX_WIDTH);
+        for (int j = 0; j < PIPELINE; j++) {
+            b[j] = _mm_xor_si128(_mm_loadu_si128(p + j), rk[0]);
+        }
+        AesniRounds<PIPELINE, 1, Nr>::encrypt(b, rk);
+        for (int j = 0; j < PIPELINE; j++) {
+            _mm_storeu_si128(p + j, b[j]);
+        }
+    }
+    for (; i < lines; i++) {
+        __m128i* p = (__m128i*)(state + i * MAX_WIDTH);
+        b[0] = _mm_xor_si128(_mm_loadu_si128(p), rk[0]);
+        AesniRounds<1, 1, Nr>::encrypt(b, rk);
+        _mm_storeu_si128(p, b[0]);
+    }
+}
+
+/**
+ * AESDEC implements the equivalent inverse cipher, so the schedule from
+ * keyExpansionInv() is used as is
+ */
+template <int Nr> AESNI static void decryptLines (int lines, unsigned char* state, unsigned char* decKey) {
+    __m128i rk[Nr + 1];
+    __m128i b[PIPELINE];
+    loadKeys(decKey, rk, Nr);
+
+    int i = 0;
+    for (; i + PIPELINE <= lines; i += PIPELINE) {
+        __m128i* p = (__m128i*)(state + i * MAX_WIDTH);
+        for (int j = 0; j < PIPELINE; j++) {
+            b[j] = _mm_xor_si128(_mm_loadu_si128(p + j), rk[Nr]);
+        }
+        AesniRounds<PIPELINE, 1, Nr>::decrypt(b, rk);
+        for (int j = 0; j < PIPELINE; j++) {
+            _mm_storeu_si128(p + j, b[j]);
+        }
+    }
+    for (; i < lines; i++) {
+        __m128i* p = (__m128i*)(state + i * MAX_WIDTH);
+        b[0] = _mm_xor_si128(_mm_loadu_si128(p), rk[Nr]);
+        AesniRounds<1, 1, Nr>::decrypt(b, rk);
+        _mm_storeu_si128(p, b[0]);
+    }
+}
+
+/**
+ * One line per lane, every lane with its own schedule. Missing lanes run
+ * lane 0 again so the eight blocks stay in flight, only real lanes are
+ * stored. Round keys are loaded per lane and round rather than kept in
+ * registers, the lane loops are unrolled so the blocks stay in registers.
+ */
+template <int Nr> AESNI static void laneLines (int lanes, unsigned char** lines, unsigned char** keys, bool inverse) {
+    __m128i b[PIPELINE];
+    const unsigned char* k[PIPELINE];
+    #pragma GCC unroll 8
+    for (int j = 0; j < PIPELINE; j++) {
+        int lane = j < lanes ? j : 0;
+        k[j] = keys[lane];
+        b[j] = _mm_xor_si128(_mm_loadu_si128((__m128i*)lines[lane]),
+                             _mm_loadu_si128((__m128i*)(k[j] + MAX_WIDTH * (inverse ? Nr : 0))));
+    }
+    if (inverse) {
+        for (int r = Nr - 1; r > 0; r--) {
+            #pragma GCC unroll 8
+            for (int j = 0; j < PIPELINE; j++) {
+                b[j] = _mm_aesdec_si128(b[j], _mm_loadu_si128((__m128i*)(k[j] + MAX_WIDTH * r)));
+            }
+        }
+        #pragma GCC unroll 8
+        for (int j = 0; j < PIPELINE; j++) {
+            b[j] = _mm_aesdeclast_si128(b[j], _mm_loadu_si128((__m128i*)k[j]));
+        }
+    } else {
+        for (int r = 1; r < Nr; r++) {
+            #pragma GCC unroll 8
+            for (int j = 0; j < PIPELINE; j++) {
+                b[j] = _mm_aesenc_si128(b[j], _mm_loadu_si128((__m128i*)(k[j] + MAX_WIDTH * r)));
+            }
+        }
+        #pragma GCC unroll 8
+        for (int j = 0; j < PIPELINE; j++) {
+            b[j] = _mm_aesenclast_si128(b[j], _mm_loadu_si128((__m128i*)(k[j] + MAX_WIDTH * Nr)));
+        }
+    }
+    for (int j = 0; j < lanes; j++) {
+        _mm_storeu_si128((__m128i*)lines[j], b[j]);
+    }
+}
+
+static void laneRun (int lanes, unsigned char** lines, unsigned char** keys, bool inverse) {
+    switch (rounds) {
+        case 12:
+            laneLines<12>(lanes, lines, keys, inverse);
+            break;
+        case 14:
+            laneLines<14>(lanes, lines, keys, inverse);
+            break;
+        default:
+            laneLines<10>(lanes, lines, keys, inverse);
+            break;
+    }
+}
+
+void aesniEncryptLanes (int lanes, unsigned char** lines, unsigned char** keys) {
+    laneRun(lanes, lines, keys, false);
+}
+
+void aesniDecryptLanes (int lanes, unsigned char** lines, unsigned char** decKeys) {
+    laneRun(lanes, lines, decKeys, true);
+}
+
+void aesniEncrypt (int lines, unsigned char* state, unsigned char* key) {
+    switch (rounds) {
+        case 12:
+            encryptLines<12>(lines, state, key);
+            break;
+        case 14:
+            encryptLines<14>(lines, state, key);
+            break;
+        default:
+            encryptLines<10>(lines, state, key);
+            break;
+    }
+}
+
+void aesniDecrypt (int lines, unsigned char* state, unsigned char* decKey) {
+    switch (rounds) {
+        case 12:
+            decryptLines<12>(lines, state, decKey);
+            break;
+        case 14:
+            decryptLines<14>(lines, state, decKey);
+            break;
+        default:
+            decryptLines<10>(lines, state, decKey);
+            break;
+    }
+}
+
+#else
+
+int aesniSupported () {
+    return 0;
+}
+
+void aesniEncrypt (int lines, unsigned char* state, unsigned char* key) {
+    encrypt(lines, state, key);
+}
+
+void aesniDecrypt (int lines, unsigned char* state, unsigned char* decKey) {
+    decryptInv(lines, state, decKey);
+}
+
+void aesniEncryptLanes (int lanes, unsigned char** lines, unsigned char** keys) {
+    for (int j = 0; j < lanes; j++) {
+        encrypt(1, lines[j], keys[j]);
+    }
+}
+
+void aesniDecryptLanes (int lanes, unsigned char** lines, unsigned char** decKeys) {
+    for (int j = 0; j < lanes; j++) {
+        decryptInv(1, lines[j], decKeys[j]);
+    }
+}
+
+#endif
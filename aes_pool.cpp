@@ -0,0 +1,191 @@
+/**
+ *  Persistent worker pool for the CPU engines
+ *  ECB lines are independent, so a job is cut into cache-sized chunks of
+ *  lines. Every worker owns a contiguous slice of the chunks and steals from
+ *  the other slices once its own is drained. The workers are created once by
+ *  poolStart() and reused by every call until poolStop().
+ */
+#include <pthread.h>
+#include "aes.h"
+
+#define MAX_WIDTH 16
+// 2048 lines = 32 KB of data per chunk, small enough to stay in L2
+#define CHUNK_LINES 2048
+#define MAX_WORKERS 256
+
+struct Slice {
+    volatile int next;    // next chunk to hand out, bumped atomically
+    int end;
+    char pad[64 - 2 * sizeof(int)];  // keep cursors on separate cache lines
+};
+
+static pthread_t threads[MAX_WORKERS];
+static Slice slices[MAX_WORKERS];
+static int workers = 1;
+static bool running = false;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static unsigned generation = 0;
+static int busy = 0;
+static bool stopping = false;
+
+// the job currently being run
+static void (*jobBody)(void* ctx, int begin, int end);
+static void* jobCtx;
+static int jobCount;
+static int jobGrain;
+
+/**
+ * Take chunks from our own slice first, then steal from the others
+ */
+static void drain (int self) {
+    for (int k = 0; k < workers; k++) {
+        Slice* s = &slices[(self + k) % workers];
+        for (;;) {
+            int c = __sync_fetch_and_add(&s->next, 1);
+            if (c >= s->end) {
+                break;
+            }
+            int begin = c * jobGrain;
+            int end = begin + jobGrain < jobCount ? begin + jobGrain : jobCount;
+            jobBody(jobCtx, begin, end);
+        }
+    }
+}
+
+static void* workerMain (void* arg) {
+    int self = (int)(long)arg;
+    unsigned seen = 0;
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (generation == seen && !stopping) {
+            pthread_cond_wait(&wake, &lock);
+        }
+        if (stopping) {
+            break;
+        }
+        seen = generation;
+        pthread_mutex_unlock(&lock);
+
+        drain(self);
+
+        pthread_mutex_lock(&lock);
+        if (--busy == 0) {
+            pthread_cond_signal(&done);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/**
+ * Start the pool, the calling thread counts as one of the workers
+ * Returns 0 on success
+ */
+int poolStart (int n) {
+    if (running) {
+        poolStop();
+    }
+    if (n < 1) {
+        n = 1;
+    }
+    if (n > MAX_WORKERS) {
+        n = MAX_WORKERS;
+    }
+    workers = n;
+    stopping = false;
+    for (int i = 1; i < workers; i++) {
+        if (pthread_create(&threads[i], NULL, workerMain, (void*)(long)i) != 0) {
+            fprintf(stderr, "Failed to create worker %d\n", i);
+            workers = i;
+            break;
+        }
+    }
+    running = true;
+    return workers == n ? 0 : -1;
+}
+
+void poolStop () {
+    if (!running) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&lock);
+    for (int i = 1; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    workers = 1;
+    running = false;
+}
+
+int poolWorkers () {
+    return workers;
+}
+
+/**
+ * Run body over [0, count) in pieces of grain items and wait for it
+ */
+void poolFor (int count, int grain, void (*body)(void* ctx, int begin, int end), void* ctx) {
+    if (grain < 1) {
+        grain = 1;
+    }
+    int chunks = (count + grain - 1) / grain;
+    if (workers == 1 || chunks <= 1) {
+        if (count > 0) {
+            body(ctx, 0, count);
+        }
+        return;
+    }
+
+    jobBody = body;
+    jobCtx = ctx;
+    jobCount = count;
+    jobGrain = grain;
+    for (int i = 0; i < workers; i++) {
+        slices[i].next = (int)((long long)chunks * i / workers);
+        slices[i].end = (int)((long long)chunks * (i + 1) / workers);
+    }
+
+    pthread_mutex_lock(&lock);
+    busy = workers - 1;
+    generation++;
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&lock);
+
+    drain(0);
+
+    pthread_mutex_lock(&lock);
+    while (busy > 0) {
+        pthread_cond_wait(&done, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+struct LinesJob {
+    unsigned char* state;
+    unsigned char* key;
+};
+
+static void encryptChunk (void* ctx, int begin, int end) {
+    LinesJob* job = (LinesJob*)ctx;
+    encrypt(end - begin, job->state + begin * MAX_WIDTH, job->key);
+}
+
+static void decryptChunk (void* ctx, int begin, int end) {
+    LinesJob* job = (LinesJob*)ctx;
+    decryptInv(end - begin, job->state + begin * MAX_WIDTH, job->key);
+}
+
+void parallelEncrypt (int lines, unsigned char* state, unsigned char* key) {
+    LinesJob job = {state, key};
+    poolFor(lines, CHUNK_LINES, encryptChunk, &job);
+}
+
+void parallelDecrypt (int lines, unsigned char* state, unsigned char* decKey) {
+    LinesJob job = {state, decKey};
+    poolFor(lines, CHUNK_LINES, decryptChunk, &job);
+}
@@ -0,0 +1,314 @@
+/**
+ *  io_uring pipeline for streamFile()
+ *  Reads of the next chunks stay in flight, depth of them, while the
+ *  calling thread hands the chunks that completed, in file order, to the
+ *  transform (the worker pool or the accelerator) and submits each write
+ *  as soon as its chunk is done. The chunk buffers are registered with the
+ *  kernel and the two files are fixed files, so a request maps neither.
+ *  Talks to the kernel through the raw system calls, liburing is not
+ *  needed. Kernels or libcs without io_uring report STREAM_UNSUPPORTED and
+ *  streamFile() falls back to its other paths.
+ */
+#include "aes.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup)
+#define AES_URING 1
+#endif
+#endif
+#endif
+
+#ifdef AES_URING
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define MAX_WIDTH 16
+// bytes per chunk, every buffer holds one
+#define URING_CHUNK (1 << 20)
+// a buffer waits to be transformed or written for every one being read
+#define URING_BUFFERS_PER_READ 2
+
+// the mapped rings of one io_uring instance
+struct Uring {
+    int fd;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    io_uring_cqe* cqes;
+    void* sqRing;
+    size_t sqRingBytes;
+    void* cqRing;
+    size_t cqRingBytes;
+    size_t sqesBytes;
+    unsigned pending;       // queued, not yet submitted
+};
+
+enum {
+    CHUNK_FREE = 0,
+    CHUNK_READING,
+    CHUNK_READ,
+    CHUNK_WRITING
+};
+
+struct UringChunk {
+    int state;
+    unsigned long long index;   // chunk of the file
+    size_t want;                // bytes of the file in the chunk
+    size_t done;                // bytes read or written so far
+    size_t bytes;               // bytes to write, padded to whole lines
+};
+
+static int uringSetup (Uring* ring, unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    ring->sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    ring->sqesBytes = params.sq_entries * sizeof(io_uring_sqe);
+    ring->sqRing = mmap(NULL, ring->sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cqRing = mmap(NULL, ring->cqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    void* sqes = mmap(NULL, ring->sqesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+        if (ring->sqRing != MAP_FAILED) {
+            munmap(ring->sqRing, ring->sqRingBytes);
+        }
+        if (ring->cqRing != MAP_FAILED) {
+            munmap(ring->cqRing, ring->cqRingBytes);
+        }
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, ring->sqesBytes);
+        }
+        close(ring->fd);
+        return -1;
+    }
+    char* sq = (char*)ring->sqRing;
+    char* cq = (char*)ring->cqRing;
+    ring->sqHead = (unsigned*)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+    ring->sqes = (io_uring_sqe*)sqes;
+    ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+static void uringClose (Uring* ring) {
+    munmap(ring->sqes, ring->sqesBytes);
+    munmap(ring->sqRing, ring->sqRingBytes);
+    munmap(ring->cqRing, ring->cqRingBytes);
+    close(ring->fd);
+}
+
+// The next free submission entry, the ring holds every request in flight
+static io_uring_sqe* uringEntry (Uring* ring) {
+    unsigned tail = *ring->sqTail;
+    unsigned index = tail & *ring->sqMask;
+    io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[index] = index;
+    // the kernel sees the entry once the tail moves past it
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    return sqe;
+}
+
+// Submits what is queued and waits for at least wait completions
+static int uringEnter (Uring* ring, unsigned wait) {
+    for (;;) {
+        int n = syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0) {
+            ring->pending -= n;
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+struct UringJob {
+    Uring ring;
+    int files[2];               // fixed file indices or the descriptors
+    bool fixedFiles;
+    bool fixedBuffers;
+    unsigned char** buffer;
+    UringChunk* chunk;
+};
+
+// Queues the rest of a read or a write of chunk c
+static void queueTransfer (UringJob* job, int c, bool write) {
+    UringChunk* ch = &job->chunk[c];
+    io_uring_sqe* sqe = uringEntry(&job->ring);
+    size_t total = write ? ch->bytes : ch->want;
+    sqe->opcode = job->fixedBuffers ? (write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED)
+                                    : (write ? IORING_OP_WRITE : IORING_OP_READ);
+    sqe->fd = job->files[write ? 1 : 0];
+    sqe->flags = job->fixedFiles ? IOSQE_FIXED_FILE : 0;
+    sqe->off = ch->index * URING_CHUNK + ch->done;
+    sqe->addr = (unsigned long long)(uintptr_t)(job->buffer[c] + ch->done);
+    sqe->len = total - ch->done;
+    sqe->buf_index = c;
+    sqe->user_data = (unsigned long long)c << 1 | (write ? 1 : 0);
+    ch->state = write ? CHUNK_WRITING : CHUNK_READING;
+}
+
+/**
+ * Streams size bytes of in to out, depth reads in flight. Both must be
+ * regular files, out is extended to the padded size.
+ * Returns the bytes written, -1 on failure, STREAM_UNSUPPORTED when no
+ * ring could be set up and nothing was done
+ */
+long long uringStream (int in, int out, unsigned long long size, int depth, StreamBody body, void* ctx) {
+    if (depth < 1) {
+        depth = 1;
+    }
+    int buffers = depth * URING_BUFFERS_PER_READ;
+    UringJob job;
+    memset(&job, 0, sizeof(job));
+    if (uringSetup(&job.ring, buffers) != 0) {
+        return STREAM_UNSUPPORTED;
+    }
+    unsigned long long padded = (size + MAX_WIDTH - 1) / MAX_WIDTH * MAX_WIDTH;
+    unsigned long long chunks = (size + URING_CHUNK - 1) / URING_CHUNK;
+
+    bool ok = ftruncate(out, padded) == 0;
+    job.buffer = (unsigned char**)calloc(buffers, sizeof(unsigned char*));
+    job.chunk = (UringChunk*)calloc(buffers, sizeof(UringChunk));
+    iovec* iov = (iovec*)calloc(buffers, sizeof(iovec));
+    ok = ok && job.buffer && job.chunk && iov;
+    for (int c = 0; ok && c < buffers; c++) {
+        job.buffer[c] = arenaAlloc(URING_CHUNK);
+        ok = job.buffer[c] != NULL;
+        if (ok) {
+            iov[c].iov_base = job.buffer[c];
+            iov[c].iov_len = URING_CHUNK;
+        }
+    }
+    // older kernels charge registered buffers to RLIMIT_MEMLOCK, without
+    // them every request pins its pages on its own
+    job.fixedBuffers = ok && syscall(__NR_io_uring_register, job.ring.fd, IORING_REGISTER_BUFFERS, iov, buffers) == 0;
+    job.files[0] = in;
+    job.files[1] = out;
+    job.fixedFiles = ok && syscall(__NR_io_uring_register, job.ring.fd, IORING_REGISTER_FILES, job.files, 2) == 0;
+    if (job.fixedFiles) {
+        job.files[0] = 0;
+        job.files[1] = 1;
+    }
+    free(iov);
+
+    unsigned long long nextRead = 0, nextCrypt = 0, written = 0;
+    int reading = 0, writing = 0;
+    while (ok && written < chunks) {
+        // keep depth reads in flight on the free buffers
+        for (int c = 0; c < buffers && reading < depth && nextRead < chunks; c++) {
+            if (job.chunk[c].state == CHUNK_FREE) {
+                UringChunk* ch = &job.chunk[c];
+                ch->index = nextRead++;
+                ch->want = size - ch->index * URING_CHUNK < URING_CHUNK ? size - ch->index * URING_CHUNK : URING_CHUNK;
+                ch->done = 0;
+                queueTransfer(&job, c, false);
+                reading++;
+            }
+        }
+        if (uringEnter(&job.ring, 1) != 0) {
+            ok = false;
+            break;
+        }
+
+        // completions arrive in any order
+        unsigned head = *job.ring.cqHead;
+        unsigned tail = __atomic_load_n(job.ring.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            io_uring_cqe* cqe = &job.ring.cqes[head & *job.ring.cqMask];
+            int c = cqe->user_data >> 1;
+            bool write = cqe->user_data & 1;
+            UringChunk* ch = &job.chunk[c];
+            if (cqe->res > 0) {
+                ch->done += cqe->res;
+            } else {
+                // an error, or the input ended early
+                ok = false;
+            }
+            if (ok && ch->done < (write ? ch->bytes : ch->want)) {
+                // short transfer, queue the rest
+                queueTransfer(&job, c, write);
+            } else if (write) {
+                ch->state = CHUNK_FREE;
+                writing--;
+                written++;
+            } else {
+                ch->state = CHUNK_READ;
+                reading--;
+            }
+        }
+        __atomic_store_n(job.ring.cqHead, head, __ATOMIC_RELEASE);
+
+        // transform in file order, cbc chains from one chunk to the next,
+        // and write each chunk as soon as it is done
+        for (bool found = true; ok && found;) {
+            found = false;
+            for (int c = 0; c < buffers; c++) {
+                UringChunk* ch = &job.chunk[c];
+                if (ch->state == CHUNK_READ && ch->index == nextCrypt) {
+                    ch->bytes = (ch->want + MAX_WIDTH - 1) / MAX_WIDTH * MAX_WIDTH;
+                    memset(job.buffer[c] + ch->want, 0, ch->bytes - ch->want);
+                    ok = body(ctx, job.buffer[c], ch->bytes / MAX_WIDTH, ch->index * (URING_CHUNK / MAX_WIDTH)) == 0;
+                    if (!ok) {
+                        // never write a chunk the body left half done
+                        break;
+                    }
+                    ch->done = 0;
+                    queueTransfer(&job, c, true);
+                    writing++;
+                    nextCrypt++;
+                    found = true;
+                }
+            }
+        }
+    }
+
+    // the kernel may still use the buffers
+    while (reading + writing > 0 && uringEnter(&job.ring, 1) == 0) {
+        unsigned head = *job.ring.cqHead;
+        unsigned tail = __atomic_load_n(job.ring.cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            if (job.ring.cqes[head & *job.ring.cqMask].user_data & 1) {
+                writing--;
+            } else {
+                reading--;
+            }
+        }
+        __atomic_store_n(job.ring.cqHead, head, __ATOMIC_RELEASE);
+    }
+    uringClose(&job.ring);
+    for (int c = 0; job.buffer && c < buffers; c++) {
+        arenaFree(job.buffer[c], URING_CHUNK);
+    }
+    free(job.buffer);
+    free(job.chunk);
+    return ok ? (long long)padded : -1;
+}
+
+#else
+
+long long uringStream (int, int, unsigned long long, int, StreamBody, void*) {
+    return STREAM_UNSUPPORTED;
+}
+
+#endif
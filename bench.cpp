@@ -0,0 +1,466 @@
+/**
+ *  Benchmark harness
+ *  Sweeps engines, modes, directions, key sizes, data sizes and thread
+ *  counts, and writes one record per run as CSV or JSON so results can be
+ *  compared between releases. A run is repeated until it used its time
+ *  budget or its repetitions, after one untimed warm-up that also pays for
+ *  the OpenCL session. Built by "make bench" into aes_bench.
+ */
+#include "aes.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define MAX_WIDTH 16
+// data unit of the XTS runs
+#define XTS_UNIT 512
+// clock of the DE1-SoC's Cortex-A9, for cycles per byte without a TSC
+#define DEFAULT_MHZ 925
+
+enum {
+    KIND_CPU = 0,       // an engine of encrypt() and decrypt()
+    KIND_HYBRID,        // CPU + accelerator
+    KIND_FPGA           // a kernel variant of the accelerator
+};
+
+struct BenchEngine {
+    const char* name;
+    int kind;
+    const char* variant;    // setEngine() or fpga_set_variant() name
+};
+
+static const BenchEngine engines[] = {
+    {"reference", KIND_CPU, "reference"},
+    {"ttable", KIND_CPU, "ttable"},
+    {"aesni", KIND_CPU, "aesni"},
+    {"bitslice", KIND_CPU, "bitslice"},
+    {"hybrid", KIND_HYBRID, "ndrange"},
+    {"fpga-ndrange", KIND_FPGA, "ndrange"},
+    {"fpga-pipe", KIND_FPGA, "pipe"},
+    {"fpga-wide4", KIND_FPGA, "wide4"},
+    {"fpga-wide8", KIND_FPGA, "wide8"},
+    {"fpga-wide16", KIND_FPGA, "wide16"},
+    {"fpga-local", KIND_FPGA, "local"}
+};
+#define NUM_ENGINES (int)(sizeof(engines) / sizeof(engines[0]))
+
+static const char* modes[] = {"ecb", "ctr", "cbc", "xts", "gcm"};
+#define NUM_MODES (int)(sizeof(modes) / sizeof(modes[0]))
+
+// one configuration being measured
+struct BenchRun {
+    const BenchEngine* engine;
+    const char* mode;
+    bool decrypt;
+    int keyBits;
+    int threads;
+    size_t bytes;
+};
+
+struct BenchResult {
+    int reps;
+    double seconds;         // all repetitions
+    double p50, p90, p99, min, max;
+    double transfer, kernel;    // device seconds per repetition, accelerator only
+};
+
+// keys of the current key size
+static unsigned char expandedKey[MAX_KEY_SCHEDULE];
+static unsigned char decryptionKey[MAX_KEY_SCHEDULE];
+static unsigned char tweakKey[MAX_KEY_SCHEDULE];
+static unsigned char iv[MAX_WIDTH];
+// the tag of the ciphertext gcm dec is timed on
+static unsigned char gcmTag[MAX_WIDTH];
+
+static double now () {
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/**
+ * Cycles per second for cycles per byte: the TSC measured against the
+ * monotonic clock where there is one, 0 otherwise
+ */
+static double cycleRate () {
+#if defined(__x86_64__) || defined(__i386__)
+    double start = now();
+    unsigned long long c0 = __rdtsc();
+    while (now() - start < 0.1) {
+    }
+    return (__rdtsc() - c0) / (now() - start);
+#else
+    return 0;
+#endif
+}
+
+// bytes with an optional K, M or G suffix
+static size_t parseSize (const char* s) {
+    char* end;
+    double v = strtod(s, &end);
+    switch (*end) {
+        case 'k': case 'K': v *= 1024.0; break;
+        case 'm': case 'M': v *= 1024.0 * 1024; break;
+        case 'g': case 'G': v *= 1024.0 * 1024 * 1024; break;
+    }
+    return v > 0 ? (size_t)v : 0;
+}
+
+// true when name is in the comma separated list
+static bool listed (const char* list, const char* name) {
+    size_t n = strlen(name);
+    for (const char* p = list; p; p = strchr(p, ',')) {
+        if (*p == ',') {
+            p++;
+        }
+        if (strncmp(p, name, n) == 0 && (p[n] == ',' || p[n] == '\0')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool engineSelected (const char* list, const BenchEngine* e) {
+    if (strcmp(list, "all") == 0) {
+        return true;
+    }
+    if (strcmp(list, "cpu") == 0) {
+        return e->kind == KIND_CPU;
+    }
+    return listed(list, e->name);
+}
+
+/**
+ * Whether the engine implements mode in that direction. CTR decrypts with
+ * the encryption, it runs once as "enc".
+ */
+static bool supported (const BenchRun* run) {
+    bool ecb = strcmp(run->mode, "ecb") == 0;
+    bool ctr = strcmp(run->mode, "ctr") == 0;
+    bool cbc = strcmp(run->mode, "cbc") == 0;
+    bool xts = strcmp(run->mode, "xts") == 0;
+    if (ctr && run->decrypt) {
+        return false;
+    }
+    switch (run->engine->kind) {
+        case KIND_HYBRID:
+            return ecb || ctr;
+        case KIND_FPGA:
+            return ecb || ctr || xts || (cbc && run->decrypt);
+        default:
+            return true;
+    }
+}
+
+// Runs once over data, returns 0 on success
+static int runOnce (const BenchRun* run, unsigned char* data) {
+    int lines = run->bytes / MAX_WIDTH;
+    const char* m = run->mode;
+    unsigned char chain[MAX_WIDTH];
+    unsigned char tag[MAX_WIDTH];
+    memcpy(chain, iv, MAX_WIDTH);
+    memset(tag, 0, MAX_WIDTH);
+
+    if (run->engine->kind == KIND_FPGA) {
+        if (strcmp(m, "ecb") == 0) {
+            return run->decrypt ? decryption_fpga(lines, data, expandedKey) : encryption_fpga(lines, data, expandedKey);
+        } else if (strcmp(m, "ctr") == 0) {
+            return ctr_fpga(lines, data, expandedKey, iv, 0);
+        } else if (strcmp(m, "cbc") == 0) {
+            return cbc_decrypt_fpga(lines, data, expandedKey, chain);
+        } else if (run->decrypt) {
+            return xts_decrypt_fpga(data, run->bytes, XTS_UNIT, expandedKey, tweakKey, 0);
+        }
+        return xts_encrypt_fpga(data, run->bytes, XTS_UNIT, expandedKey, tweakKey, 0);
+    }
+    if (run->engine->kind == KIND_HYBRID) {
+        if (strcmp(m, "ctr") == 0) {
+            hybridCtr(lines, data, expandedKey, iv, 0);
+        } else if (run->decrypt) {
+            hybridDecrypt(lines, data, expandedKey, decryptionKey);
+        } else {
+            hybridEncrypt(lines, data, expandedKey);
+        }
+        return 0;
+    }
+
+    if (strcmp(m, "ecb") == 0) {
+        if (run->decrypt) {
+            parallelDecrypt(lines, data, decryptionKey);
+        } else {
+            parallelEncrypt(lines, data, expandedKey);
+        }
+    } else if (strcmp(m, "ctr") == 0) {
+        parallelCtr(lines, data, expandedKey, iv, 0);
+    } else if (strcmp(m, "cbc") == 0) {
+        if (run->decrypt) {
+            parallelCbcDecrypt(lines, data, decryptionKey, chain);
+        } else {
+            cbcEncrypt(lines, data, expandedKey, chain);
+        }
+    } else if (strcmp(m, "xts") == 0) {
+        return run->decrypt ? xtsDecrypt(data, run->bytes, XTS_UNIT, decryptionKey, tweakKey, 0)
+                            : xtsEncrypt(data, run->bytes, XTS_UNIT, expandedKey, tweakKey, 0);
+    } else if (run->decrypt) {
+        return gcmDecrypt(data, run->bytes, NULL, 0, expandedKey, iv, gcmTag);
+    } else {
+        gcmEncrypt(data, run->bytes, NULL, 0, expandedKey, iv, tag);
+    }
+    return 0;
+}
+
+/**
+ * Untimed set-up before each run: gcm dec gets data encrypted under the
+ * bench key and its tag, so the timed run takes the accepting path
+ */
+static void prepare (const BenchRun* run, unsigned char* data) {
+    if (run->engine->kind == KIND_CPU && run->decrypt && strcmp(run->mode, "gcm") == 0) {
+        gcmEncrypt(data, run->bytes, NULL, 0, expandedKey, iv, gcmTag);
+    }
+}
+
+static int compareTimes (const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// nearest-rank percentile of sorted times
+static double percentile (const double* times, int n, double p) {
+    int i = (int)ceil(p * n) - 1;
+    return times[i < 0 ? 0 : i];
+}
+
+/**
+ * Times run until budget seconds or maxReps repetitions, at least one
+ * Returns 0 on success, -1 when the engine failed
+ */
+static int measure (const BenchRun* run, unsigned char* data, double budget, int maxReps, double* times, BenchResult* r) {
+    prepare(run, data);
+    if (runOnce(run, data) != 0) {
+        return -1;
+    }
+    bool device = run->engine->kind == KIND_FPGA;
+    memset(r, 0, sizeof(*r));
+    double begin = now();
+    do {
+        prepare(run, data);
+        double start = now();
+        if (runOnce(run, data) != 0) {
+            return -1;
+        }
+        times[r->reps++] = now() - start;
+        if (device) {
+            r->transfer += fpga_transfer_time();
+            r->kernel += fpga_kernel_time();
+        }
+    } while (r->reps < maxReps && now() - begin < budget);
+
+    for (int i = 0; i < r->reps; i++) {
+        r->seconds += times[i];
+    }
+    r->transfer /= r->reps;
+    r->kernel /= r->reps;
+    qsort(times, r->reps, sizeof(double), compareTimes);
+    r->p50 = percentile(times, r->reps, 0.50);
+    r->p90 = percentile(times, r->reps, 0.90);
+    r->p99 = percentile(times, r->reps, 0.99);
+    r->min = times[0];
+    r->max = times[r->reps - 1];
+    return 0;
+}
+
+static void writeRecord (FILE* out, bool json, bool first, const BenchRun* run, const BenchResult* r, double hz) {
+    double mean = r->seconds / r->reps;
+    double gbps = run->bytes / mean / 1e9;
+    double cpb = mean * hz / run->bytes;
+    const char* dir = run->decrypt ? "dec" : "enc";
+    if (json) {
+        fprintf(out, "%s  {\"engine\": \"%s\", \"mode\": \"%s\", \"direction\": \"%s\", \"key_bits\": %d, "
+                "\"threads\": %d, \"bytes\": %zu, \"reps\": %d, \"gb_per_s\": %.4f, \"cycles_per_byte\": %.3f, "
+                "\"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, \"min_us\": %.3f, \"max_us\": %.3f, "
+                "\"transfer_us\": %.3f, \"kernel_us\": %.3f}",
+                first ? "" : ",\n", run->engine->name, run->mode, dir, run->keyBits, run->threads, run->bytes, r->reps,
+                gbps, cpb, r->p50 * 1e6, r->p90 * 1e6, r->p99 * 1e6, r->min * 1e6, r->max * 1e6,
+                r->transfer * 1e6, r->kernel * 1e6);
+    } else {
+        fprintf(out, "%s,%s,%s,%d,%d,%zu,%d,%.4f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+                run->engine->name, run->mode, dir, run->keyBits, run->threads, run->bytes, r->reps,
+                gbps, cpb, r->p50 * 1e6, r->p90 * 1e6, r->p99 * 1e6, r->min * 1e6, r->max * 1e6,
+                r->transfer * 1e6, r->kernel * 1e6);
+    }
+    fflush(out);
+}
+
+static void usage (const char* name) {
+    fprintf(stderr, "Usage: %s [-e cpu|all|engine,...] [-m ecb,ctr,cbc,xts,gcm] [-d enc,dec] [-k 128,192,256]\n"
+            "       [-t threads,...] [-s min:max[:factor]] [-r max_reps] [-b seconds_per_run] [-c fpga_chunk_lines]\n"
+            "       [-z cpu_mhz] [-j] [-o output_file]\n"
+            "engines:", name);
+    for (int e = 0; e < NUM_ENGINES; e++) {
+        fprintf(stderr, " %s", engines[e].name);
+    }
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+int main (int argc, char *argv[]) {
+    const char* engineList = "cpu";
+    const char* modeList = "ecb,ctr,cbc,xts,gcm";
+    const char* dirList = "enc,dec";
+    const char* keyList = "128";
+    const char* threadList = NULL;
+    const char* outName = NULL;
+    size_t minBytes = 16, maxBytes = 64 << 20, factor = 4;
+    int maxReps = 1000;
+    double budget = 0.5;
+    double mhz = DEFAULT_MHZ;
+    bool json = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "e:m:d:k:t:s:r:b:c:z:jo:")) != -1) {
+        switch (opt) {
+            case 'e': engineList = optarg; break;
+            case 'm': modeList = optarg; break;
+            case 'd': dirList = optarg; break;
+            case 'k': keyList = optarg; break;
+            case 't': threadList = optarg; break;
+            case 's': {
+                char* p = strchr(optarg, ':');
+                if (p == NULL) {
+                    usage(argv[0]);
+                }
+                minBytes = parseSize(optarg);
+                maxBytes = parseSize(p + 1);
+                p = strchr(p + 1, ':');
+                factor = p ? parseSize(p + 1) : 4;
+                break;
+            }
+            case 'r': maxReps = atoi(optarg); break;
+            case 'b': budget = atof(optarg); break;
+            case 'c': fpga_chunk_lines(atoi(optarg)); break;
+            case 'z': mhz = atof(optarg); break;
+            case 'j': json = true; break;
+            case 'o': outName = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || maxReps < 1 || factor < 2 || minBytes < MAX_WIDTH || maxBytes < minBytes) {
+        usage(argv[0]);
+    }
+
+    // 1 and every core by default
+    char cores[32];
+    if (threadList == NULL) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        snprintf(cores, sizeof(cores), n > 1 ? "1,%ld" : "1", n);
+        threadList = cores;
+    }
+    FILE* out = stdout;
+    if (outName && (out = fopen(outName, "w")) == NULL) {
+        fprintf(stderr, "Cannot open %s\n", outName);
+        exit(EXIT_FAILURE);
+    }
+
+    maxBytes -= maxBytes % MAX_WIDTH;
+    unsigned char* data = arenaAlloc(maxBytes);
+    double* times = (double*)malloc(maxReps * sizeof(double));
+    if (data == NULL || times == NULL) {
+        fprintf(stderr, "Cannot allocate %zu bytes\n", maxBytes);
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < maxBytes; i++) {
+        data[i] = (unsigned char)(i * 131 + 7);
+    }
+    // the data key and the xts tweak key, the iv of main()
+    unsigned char key[64];
+    for (int i = 0; i < 64; i++) {
+        key[i] = (unsigned char)(i + 1);
+    }
+    for (int i = 0; i < MAX_WIDTH; i++) {
+        iv[i] = (unsigned char)(0xf0 + i);
+    }
+    // without a TSC the clock comes from -z
+    double hz = cycleRate();
+    if (hz == 0) {
+        hz = mhz * 1e6;
+    }
+
+    if (json) {
+        fprintf(out, "[\n");
+    } else {
+        fprintf(out, "engine,mode,direction,key_bits,threads,bytes,reps,gb_per_s,cycles_per_byte,"
+                "p50_us,p90_us,p99_us,min_us,max_us,transfer_us,kernel_us\n");
+    }
+    keyCacheStart(KEY_CACHE_ENTRIES);
+    bool first = true;
+    bool fpgaFailed = false;
+    int bits[3] = {128, 192, 256};
+    for (int b = 0; b < 3; b++) {
+        char name[8];
+        snprintf(name, sizeof(name), "%d", bits[b]);
+        if (!listed(keyList, name)) {
+            continue;
+        }
+        setKeySize(bits[b]);
+        cachedKeyExpansion(key, expandedKey, decryptionKey);
+        cachedKeyExpansion(key + 32, tweakKey, NULL);
+
+        for (const char* t = threadList; t; t = strchr(t + 1, ',')) {
+            int threads = atoi(*t == ',' ? t + 1 : t);
+            bool firstThreads = t == threadList;
+            poolStart(threads);
+            for (int e = 0; e < NUM_ENGINES; e++) {
+                const BenchEngine* engine = &engines[e];
+                // the kernels do not use the pool
+                if (!engineSelected(engineList, engine) || (engine->kind == KIND_FPGA && !firstThreads)) {
+                    continue;
+                }
+                if (engine->kind == KIND_CPU && setEngine(engine->variant) != 0) {
+                    fprintf(stderr, "Skipping %s, not supported here\n", engine->name);
+                    continue;
+                }
+                if (engine->kind != KIND_CPU) {
+                    if (fpgaFailed) {
+                        continue;
+                    }
+                    setEngine("auto");
+                    fpga_set_variant(engine->variant);
+                    if (fpga_open() != 0) {
+                        fprintf(stderr, "Skipping the accelerator, no OpenCL session\n");
+                        fpgaFailed = true;
+                        continue;
+                    }
+                }
+                for (int m = 0; m < NUM_MODES; m++) {
+                    for (int d = 0; d < 2; d++) {
+                        BenchRun run = {engine, modes[m], d == 1, bits[b], engine->kind == KIND_FPGA ? 1 : poolWorkers(), 0};
+                        if (!listed(modeList, run.mode) || !listed(dirList, d ? "dec" : "enc") || !supported(&run)) {
+                            continue;
+                        }
+                        for (size_t bytes = minBytes; bytes <= maxBytes; bytes *= factor) {
+                            run.bytes = bytes - bytes % MAX_WIDTH;
+                            BenchResult r;
+                            if (measure(&run, data, budget, maxReps, times, &r) != 0) {
+                                fprintf(stderr, "%s %s failed at %zu bytes\n", engine->name, run.mode, run.bytes);
+                                break;
+                            }
+                            writeRecord(out, json, first, &run, &r, hz);
+                            first = false;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    if (json) {
+        fprintf(out, "\n]\n");
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+    fpga_close();
+    poolStop();
+    keyCacheStop();
+    free(times);
+    arenaFree(data, maxBytes);
+    return 0;
+}
@@ -27,7 +27,14 @@
 #include <stdlib.h>
 #include <string>
 
+#ifndef CL_TARGET_OPENCL_VERSION
+#define CL_TARGET_OPENCL_VERSION 120
+#endif
+#ifdef APPLE
+#include <OpenCL/opencl.h>
+#else
 #include "CL/opencl.h"
+#endif
 
 namespace aocl_utils {
 
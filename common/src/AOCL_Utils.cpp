@@ -427,6 +427,7 @@ unsigned char *loadBinaryFile(const char *file_name, size_t *size) {
     fclose(fp);
     return NULL;
   }
+  fclose(fp);
 
   return binary;
 }
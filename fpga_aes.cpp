@@ -1,34 +1,67 @@
 #include "aes.h"
+// The single work-item kernels start with clEnqueueTask and the queues
+// come from clCreateCommandQueue, both OpenCL 1.2 calls that current
+// headers (pocl, Khronos) mark deprecated unless asked for
+#define CL_TARGET_OPENCL_VERSION 120
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
 #ifdef APPLE
 #include <OpenCL/opencl.h>
 #else
 #include "CL/opencl.h"
+#endif
 #include "AOCL_Utils.h"
+#include <algorithm>
 
 
 using namespace aocl_utils;
 
 #define MAX_WIDTH 16
+// only the Altera headers have the bank flags
+#ifndef CL_MEM_BANK_1_ALTERA
+#define CL_MEM_BANK_1_ALTERA 0
 #endif
-#ifdef APPLE
-// OpenCL runtime configuration
-cl_platform_id platform = NULL;
-unsigned num_devices = 1;
-cl_device_id device; // num_devices elements
-cl_context context = NULL;
-cl_command_queue queue; // num_devices elements
-cl_program program = NULL;
-cl_kernel kernel; // num_devices elements
-#else
+
 // OpenCL runtime configuration
 cl_platform_id platform = NULL;
 unsigned num_devices = 0;
 scoped_array<cl_device_id> device; // num_devices elements
 cl_context context = NULL;
-scoped_array<cl_command_queue> queue; // num_devices elements
+scoped_array<cl_command_queue> queue; // num_devices elements, runs the kernels
+scoped_array<cl_command_queue> write_queue, read_queue; // num_devices elements, host to device and back
 cl_program program = NULL;
-scoped_array<cl_kernel> kernel; // num_devices elements
-#endif
+scoped_array<cl_kernel> kernel; // num_devices * NUM_KERNELS elements, see find_kernel()
+cl_mem_flags bank_flags = 0; // CL_MEM_BANK_1_ALTERA on Altera, other platforms reject it
+
+// Every kernel in aes.cl, all of them are created once per session
+static const char *kernel_names[] = {"encrypt", "decrypt", "ctr_xcrypt", "cbc_decrypt",
+                                     "xts_encrypt", "xts_decrypt", "ghash_partial",
+                                     "encrypt_pipe", "decrypt_pipe",
+                                     "encrypt_wide", "decrypt_wide",
+                                     "encrypt_local", "decrypt_local",
+                                     "encrypt_batch", "decrypt_batch"};
+#define NUM_KERNELS (sizeof(kernel_names) / sizeof(kernel_names[0]))
+
+// Kernels for encryption_fpga() and decryption_fpga(), picked with fpga_set_variant()
+enum {
+    VARIANT_NDRANGE = 0,    // a work-item per line
+    VARIANT_PIPE,           // one pipelined work-item over all lines
+    VARIANT_WIDE4,          // 4, 8 or 16 lines per work-item
+    VARIANT_WIDE8,
+    VARIANT_WIDE16,
+    VARIANT_LOCAL           // T-tables in local memory
+};
+static const char *variant_names[] = {"ndrange", "pipe", "wide4", "wide8", "wide16", "local"};
+static const char *encrypt_kernels[] = {"encrypt", "encrypt_pipe", "encrypt_wide", "encrypt_wide", "encrypt_wide", "encrypt_local"};
+static const char *decrypt_kernels[] = {"decrypt", "decrypt_pipe", "decrypt_wide", "decrypt_wide", "decrypt_wide", "decrypt_local"};
+// lines per work-item the program must be built with, 0 for any
+static const int variant_blocks[] = {0, 0, 4, 8, 16, 0};
+int variant = VARIANT_NDRANGE;
+// BLOCKS of the default binaries, see aes.cl
+#define DEFAULT_BLOCKS 4
+// reqd_work_group_size of the local kernels, the LOCAL_GROUP of aes.cl
+#define LOCAL_GROUP 64
+// copies of the local T-table, spread over the local memory banks
+#define LOCAL_COPIES 4
 
 // program data
 char *mode;
@@ -36,41 +69,256 @@ unsigned char *input;
 unsigned char *key;
 unsigned char *output;
 int size;
+// starting counter block for the ctr_xcrypt kernel
+cl_ulong counter_hi, counter_lo;
+// ciphertext line in front of input for the cbc_decrypt kernel
+const unsigned char *chain_iv;
+// tweak key, first unit number and lines per unit for the xts kernels
+unsigned char *tweak_key;
+cl_ulong xts_unit0;
+size_t xts_group;
+// key table and the key of every line of the request for the batch kernels
+unsigned char *batch_keys;
+size_t batch_num_keys;
+scoped_array<cl_uint> batch_ids;
+// ids of the lines between the messages of a batch, NO_KEY of aes.cl
+#define NO_KEY 0xffffffffu
 
 // opencl parameter
-cl_mem fpga_a, fpga_b;
+// a: ghash data, c: extra input, d: extra output
+cl_mem fpga_a = NULL, fpga_c = NULL, fpga_d = NULL;
+// bytes allocated for the buffers that grow with the request
+size_t fpga_a_bytes = 0, fpga_c_bytes = 0, fpga_d_bytes = 0;
 
-#ifdef APPLE
-static int LoadTextFromFile(const char *file_name, char **result_string, size_t *string_len);
-#define LOCAL_MEM_SIZE = 1024;
-void _checkError(int line, const char *file, cl_int error, const char *msg, ...);
-#define checkError(status, ...) _checkError(__LINE__, __FILE__, status, __VA_ARGS__)
-#endif
+// Requests stream through the device a chunk at a time, every slot holds
+// one chunk: three slots keep an upload, a kernel and a download in flight.
+#define STREAM_SLOTS 3
+#define STREAM_LINES (1 << 18)
+size_t chunk_lines = STREAM_LINES;
+
+// Every device streams its own share of a request with its own buffers.
+struct device_stream {
+    cl_mem key;                             // round keys
+    cl_mem tweak;                           // xts tweak key
+    cl_mem keys, ids;                       // batch key table and line keys
+    size_t keys_bytes, ids_bytes;
+    cl_mem a[STREAM_SLOTS];                 // data
+    cl_mem c[STREAM_SLOTS];                 // cbc ciphertext with the line in front
+    size_t a_bytes[STREAM_SLOTS], c_bytes[STREAM_SLOTS];
+    // the share in flight, see stream_prepare()
+    size_t first;
+    size_t lines;
+    size_t chunk;
+    size_t chunks;
+    scoped_array<cl_event> write_event, kernel_event, read_event;
+    scoped_array<unsigned char> chain;
+    double rate;                            // measured lines per second, 0 until known
+};
+scoped_array<device_stream> streams;        // num_devices elements
+
+// Device-visible host memory from fpga_alloc(). While mapped the host owns
+// it, a request unmaps it for the kernel and maps it back, nothing is copied.
+#define MAX_HOST_BUFFERS 16
+struct host_buffer {
+    cl_mem mem;
+    unsigned char *ptr;
+    size_t bytes;
+};
+host_buffer host_buffers[MAX_HOST_BUFFERS];
+
+// The accelerator session: platform, context, program, queues, kernels and
+// buffers are set up by fpga_open() and kept until fpga_close(), so a
+// request only pays for its transfers and its kernel.
+bool session_open = false;
+int session_rounds = 0;      // the binary is built for one key size
+int session_blocks = 0;      // and one BLOCKS of the wide kernels
+double setup_time = 0;       // seconds spent in the last fpga_open()
+double call_time = 0;        // seconds spent in the last request
+double transfer_time = 0;    // device seconds of its uploads and downloads
+double kernel_time = 0;      // and of its kernels
+FILE *session_log = stdout;  // progress messages, see fpga_set_log()
 
 bool init_opencl();
+cl_platform_id choose_platform();
+cl_program build_program_cached(cl_context ctx, unsigned num, const cl_device_id *devs, const char *source, size_t length, const char *options);
+bool run_opencl();
+bool ensure_buffer(cl_mem *buf, size_t *have, size_t bytes, cl_mem_flags flags);
+bool run_ghash(int num_of_lines, const unsigned char *data, const unsigned char *h, unsigned char *y);
 void cleanup();
 
+/**
+ * Open the accelerator session, a no-op while one is open for the current
+ * key size and wide variant. Every *_fpga() call opens it on first use.
+ * Returns 0 on success
+ */
+int fpga_open () {
+    int blocks = variant_blocks[variant];
+    if (session_open && session_rounds == rounds && (blocks == 0 || blocks == session_blocks)) {
+        return 0;
+    }
+    if (session_open) {
+        // the program was built for another key size or BLOCKS
+        cleanup();
+    }
+    session_blocks = blocks ? blocks : DEFAULT_BLOCKS;
+    double start = getCurrentTimestamp();
+    if (!init_opencl()) {
+        return -1;
+    }
+    session_open = true;
+    session_rounds = rounds;
+    setup_time = getCurrentTimestamp() - start;
+    fprintf(session_log, "OpenCL setup: %.3f ms\n", setup_time * 1e3);
+    return 0;
+}
+
+void fpga_close () {
+    if (session_open) {
+        cleanup();
+    }
+}
+
+/**
+ * Picks the kernel of encryption_fpga() and decryption_fpga(): "ndrange"
+ * runs a work-item per line, "pipe" a single pipelined work-item and
+ * "wide4", "wide8" or "wide16" that many lines per work-item and "local"
+ * a work-item per line with the T-tables in local memory.
+ * Returns 0 on success, -1 for an unknown name
+ */
+int fpga_set_variant (const char *name) {
+    for (unsigned v = 0; v < sizeof(variant_names) / sizeof(variant_names[0]); v++) {
+        if (strcmp(name, variant_names[v]) == 0) {
+            variant = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Sets the lines per chunk of the streaming pipeline, the default is
+ * STREAM_LINES. Returns the previous value
+ */
+int fpga_chunk_lines (int num_of_lines) {
+    int previous = (int)chunk_lines;
+    if (num_of_lines > 0) {
+        chunk_lines = num_of_lines;
+    }
+    return previous;
+}
+
+/**
+ * Sends the messages of the session (platform, devices, program, setup
+ * time) to log, stdout by default. For callers whose stdout carries data
+ */
+void fpga_set_log (FILE *log) {
+    session_log = log ? log : stdout;
+}
+
+/**
+ * Allocates bytes of memory the host and the device share (CL_MEM_ALLOC_HOST_PTR),
+ * mapped for the host. Requests whose data starts at the returned pointer run
+ * in place without transfers, which saves every copy on shared-memory boards.
+ * The memory is valid until fpga_free(), fpga_close() or a rebuild of the
+ * session for another key size or wide variant.
+ * Returns NULL on failure
+ */
+unsigned char *fpga_alloc (size_t bytes) {
+    cl_int status;
+    if (bytes == 0 || fpga_open() != 0) {
+        return NULL;
+    }
+    for (int b = 0; b < MAX_HOST_BUFFERS; b++) {
+        if (host_buffers[b].mem == NULL) {
+            cl_mem mem = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, bytes, NULL, &status);
+            if (status != CL_SUCCESS) {
+                return NULL;
+            }
+            void *ptr = clEnqueueMapBuffer(queue[0], mem, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, bytes, 0, NULL, NULL, &status);
+            if (status != CL_SUCCESS) {
+                clReleaseMemObject(mem);
+                return NULL;
+            }
+            host_buffers[b].mem = mem;
+            host_buffers[b].ptr = (unsigned char *)ptr;
+            host_buffers[b].bytes = bytes;
+            return host_buffers[b].ptr;
+        }
+    }
+    return NULL;
+}
+
+static void release_host_buffer (host_buffer *hb) {
+    clEnqueueUnmapMemObject(queue[0], hb->mem, hb->ptr, 0, NULL, NULL);
+    clFinish(queue[0]);
+    clReleaseMemObject(hb->mem);
+    hb->mem = NULL;
+    hb->ptr = NULL;
+    hb->bytes = 0;
+}
+
+// Releases memory from fpga_alloc().
+void fpga_free (unsigned char *ptr) {
+    for (int b = 0; b < MAX_HOST_BUFFERS; b++) {
+        if (ptr != NULL && host_buffers[b].ptr == ptr) {
+            release_host_buffer(&host_buffers[b]);
+        }
+    }
+}
+
+// The fpga_alloc() buffer that starts at ptr and holds bytes, or NULL.
+static host_buffer *find_host_buffer (const unsigned char *ptr, size_t bytes) {
+    for (int b = 0; b < MAX_HOST_BUFFERS; b++) {
+        if (host_buffers[b].mem != NULL && host_buffers[b].ptr == ptr && host_buffers[b].bytes >= bytes) {
+            return &host_buffers[b];
+        }
+    }
+    return NULL;
+}
+
+// seconds spent setting up the session and in the last request
+double fpga_setup_time () {
+    return setup_time;
+}
+
+double fpga_call_time () {
+    return call_time;
+}
+
+// device time of the last request in transfers and in kernels, summed over
+// chunks and devices, so with overlap they add up to more than the call
+double fpga_transfer_time () {
+    return transfer_time;
+}
+
+double fpga_kernel_time () {
+    return kernel_time;
+}
+
+// seconds between the start and the end of a profiled command, 0 if unknown
+static double event_time (cl_event event) {
+    cl_ulong start = 0, end = 0;
+    if (clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL) != CL_SUCCESS ||
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL) != CL_SUCCESS ||
+        end < start) {
+        return 0;
+    }
+    return (end - start) * 1e-9;
+}
+
 /**
  * The fpga encryption function
  */
 int encryption_fpga (int num_of_lines, unsigned char *data, unsigned char *k) {
     // assign global variables
-    mode = (char *)malloc(7 * sizeof(char));
-    std::string s = "encrypt";   
-    s.copy(mode, 7 * sizeof(char));
-    
+    mode = (char *)encrypt_kernels[variant];
     size = num_of_lines;
     key = k;
-    memcpy(input, data, size * MAX_WIDTH * sizeof(unsigned char));
-    memcpy(output, data, size * MAX_WIDTH * sizeof(unsigned char));
-    // sort the list
-    // Initialize the problem data.
-    if (!init_opencl()) {
-    return -1;
+    input = data;
+    output = data;
+    if (fpga_open() != 0 || !run_opencl()) {
+        return -1;
     }
-    // clean and return
-    memcpy(data, output, size * sizeof(float));
-    cleanup();
     return 0;
 }
 
@@ -78,243 +326,1024 @@ int encryption_fpga (int num_of_lines, unsigned char *data, unsigned char *k) {
  * The fpga decryption function
  */
 int decryption_fpga (int num_of_lines, unsigned char *data, unsigned char *k) {
-    // assign global variables  
-    mode = (char *)malloc(7 * sizeof(char));
-    std::string s = "decrypt";   
-    s.copy(mode, 7 * sizeof(char));
+    // assign global variables
+    mode = (char *)decrypt_kernels[variant];
+    size = num_of_lines;
+    key = k;
+    input = data;
+    output = data;
+    if (fpga_open() != 0 || !run_opencl()) {
+        return -1;
+    }
+    return 0;
+}
 
+/**
+ * The fpga CTR mode function, encrypts and decrypts in place
+ * block is the position of data[0] in the stream started at iv
+ */
+int ctr_fpga (int num_of_lines, unsigned char *data, unsigned char *k, const unsigned char *iv, unsigned long long block) {
+    unsigned char counter[MAX_WIDTH];
+    mode = (char *)"ctr_xcrypt";
     size = num_of_lines;
     key = k;
-    memcpy(input, data, size * MAX_WIDTH * sizeof(unsigned char));
-    memcpy(output, data, size * MAX_WIDTH * sizeof(unsigned char));
-    // sort the list
-    // Initialize the problem data.
-    if (!init_opencl()) {
+    input = data;
+    output = data;
+    ctrCounter(iv, block, counter);
+    counter_hi = 0;
+    counter_lo = 0;
+    for (int i = 0; i < 8; i++) {
+        counter_hi = (counter_hi << 8) | counter[i];
+        counter_lo = (counter_lo << 8) | counter[8 + i];
+    }
+    if (fpga_open() != 0 || !run_opencl()) {
         return -1;
     }
-    // clean and return
-    memcpy(data, output, size * MAX_WIDTH * sizeof(unsigned char));
-    cleanup();
     return 0;
 }
 
-// Initializes the OpenCL objects.
-bool init_opencl() {
-    int err;
+/**
+ * The fpga CBC decryption function, decrypts in place
+ * iv is replaced by the last ciphertext line like cbcDecrypt()
+ */
+int cbc_decrypt_fpga (int num_of_lines, unsigned char *data, unsigned char *k, unsigned char *iv) {
+    if (num_of_lines <= 0) {
+        return 0;
+    }
+    unsigned char last[MAX_WIDTH];
+    memcpy(last, data + (num_of_lines - 1) * MAX_WIDTH, MAX_WIDTH);
+    mode = (char *)"cbc_decrypt";
+    size = num_of_lines;
+    key = k;
+    input = data;
+    output = data;
+    chain_iv = iv;
+    if (fpga_open() != 0 || !run_opencl()) {
+        return -1;
+    }
+    memcpy(iv, last, MAX_WIDTH);
+    return 0;
+}
+
+/**
+ * Whole data units go to the xts kernel, one work-group per unit. A short
+ * last unit needs ciphertext stealing across lines and is left to the CPU.
+ */
+static int xts_fpga (bool decrypting, unsigned char *data, size_t len, int unit, unsigned char *k1, unsigned char *k2, unsigned long long unit0) {
+    size_t tail = len % unit;
+    size_t whole = len / unit;
+    if (unit < MAX_WIDTH || unit % MAX_WIDTH != 0 || (tail != 0 && tail < MAX_WIDTH)) {
+        return -1;
+    }
+    if (whole > 0) {
+        mode = (char *)(decrypting ? "xts_decrypt" : "xts_encrypt");
+        size = (int)(whole * unit / MAX_WIDTH);
+        key = k1;
+        input = data;
+        output = data;
+        tweak_key = k2;
+        xts_unit0 = unit0;
+        xts_group = unit / MAX_WIDTH;
+        if (fpga_open() != 0 || !run_opencl()) {
+            return -1;
+        }
+    }
+    if (tail != 0) {
+        if (decrypting) {
+            unsigned char dec_key[MAX_KEY_SCHEDULE];
+            keyExpansionInv(k1, dec_key);
+            return xtsDecrypt(data + whole * unit, tail, unit, dec_key, k2, unit0 + whole);
+        }
+        return xtsEncrypt(data + whole * unit, tail, unit, k1, k2, unit0 + whole);
+    }
+    return 0;
+}
+
+/**
+ * The fpga XTS functions, in place over data units of unit bytes
+ * k1 and k2 are the expanded data and tweak keys
+ */
+int xts_encrypt_fpga (unsigned char *data, size_t len, int unit, unsigned char *k1, unsigned char *k2, unsigned long long unit0) {
+    return xts_fpga(false, data, len, unit, k1, k2, unit0);
+}
+
+int xts_decrypt_fpga (unsigned char *data, size_t len, int unit, unsigned char *k1, unsigned char *k2, unsigned long long unit0) {
+    return xts_fpga(true, data, len, unit, k1, k2, unit0);
+}
+
+/**
+ * GHASH of whole lines on the device, starting from zero
+ * h is the hash key E(K, 0^128), the result goes to y. No lines (an empty
+ * AAD or ciphertext) hash to zero without a device call.
+ */
+int ghash_fpga (int num_of_lines, const unsigned char *data, const unsigned char *h, unsigned char *y) {
+    if (num_of_lines <= 0) {
+        memset(y, 0, MAX_WIDTH);
+        return 0;
+    }
+    mode = (char *)"ghash_partial";
+    if (fpga_open() != 0 || !run_ghash(num_of_lines, data, h, y)) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Sets up a batch: the line keys of its lines, NO_KEY between messages.
+ * Returns the lines the batch spans, -1 for a key outside the table or a
+ * message outside int.
+ */
+static int batch_lines(int count, const BatchEntry *entries, int num_keys) {
+    long long lines = 0;
+    for (int e = 0; e < count; e++) {
+        const BatchEntry &b = entries[e];
+        if (b.key < 0 || b.key >= num_keys || b.offset < 0 || b.lines < 0) {
+            return -1;
+        }
+        if ((long long)b.offset + b.lines > lines) {
+            lines = (long long)b.offset + b.lines;
+        }
+    }
+    if (lines > 0x7fffffff) {
+        return -1;
+    }
+    batch_ids.reset(lines > 0 ? lines : 1);
+    for (long long l = 0; l < lines; l++) {
+        batch_ids[l] = NO_KEY;
+    }
+    for (int e = 0; e < count; e++) {
+        for (int l = 0; l < entries[e].lines; l++) {
+            batch_ids[entries[e].offset + l] = entries[e].key;
+        }
+    }
+    return (int)lines;
+}
+
+static int batch_fpga(bool decrypt, int count, const BatchEntry *entries, unsigned char *data, int num_keys, unsigned char *keys) {
+    int lines = batch_lines(count, entries, num_keys);
+    if (lines < 0) {
+        return -1;
+    }
+    if (lines == 0) {
+        return 0;
+    }
+    mode = (char *)(decrypt ? "decrypt_batch" : "encrypt_batch");
+    size = lines;
+    input = data;
+    output = data;
+    batch_keys = keys;
+    batch_num_keys = num_keys;
+    if (fpga_open() != 0 || !run_opencl()) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * The fpga batch functions, every message of the batch with its own key
+ * in one request. keys holds num_keys keyExpansion() schedules
+ * MAX_KEY_SCHEDULE bytes apart, decryption uses them as well.
+ * The lines between the messages are moved but not changed.
+ */
+int batch_encrypt_fpga (int count, const BatchEntry *entries, unsigned char *data, int num_keys, unsigned char *keys) {
+    return batch_fpga(false, count, entries, data, num_keys, keys);
+}
+
+int batch_decrypt_fpga (int count, const BatchEntry *entries, unsigned char *data, int num_keys, unsigned char *keys) {
+    return batch_fpga(true, count, entries, data, num_keys, keys);
+}
+
+// FNV-1a over len bytes, continuing from h
+static unsigned long long fnv1a(unsigned long long h, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Writes a program binary aside and renames it, a concurrent start never reads half a file
+static void store_program(const std::string &path, const unsigned char *binary, size_t size) {
+    char temp[1100];
+    snprintf(temp, sizeof(temp), "%s.%d", path.c_str(), (int)getpid());
+    FILE *out = fopen(temp, "wb");
+    if (out) {
+        bool written = fwrite(binary, size, 1, out) == 1;
+        if (fclose(out) == 0 && written && rename(temp, path.c_str()) == 0) {
+            fprintf(session_log, "Stored program: %s\n", path.c_str());
+        } else {
+            remove(temp);
+        }
+    }
+}
+
+/**
+ * Builds the kernel source for the num devices devs with options through a
+ * cache of program binaries in $AES_CL_CACHE, the working directory by
+ * default. Every device has its own file, the name hashes the device name,
+ * the driver version, the source and the options, so only the first start
+ * of a configuration compiles. Binaries the driver rejects are compiled and
+ * stored again.
+ */
+cl_program build_program_cached(cl_context ctx, unsigned num, const cl_device_id *devs, const char *source, size_t length, const char *options) {
     cl_int status;
+    const char *dir = getenv("AES_CL_CACHE");
+    scoped_array<std::string> paths(num);
+    scoped_array<size_t> sizes(num);
+    scoped_array<unsigned char *> binaries(num);
+    bool cached = true;
+    for (unsigned i = 0; i < num; i++) {
+        char name[256] = "", driver[256] = "";
+        clGetDeviceInfo(devs[i], CL_DEVICE_NAME, sizeof(name), name, NULL);
+        clGetDeviceInfo(devs[i], CL_DRIVER_VERSION, sizeof(driver), driver, NULL);
+        unsigned long long h = 14695981039346656037ULL;
+        h = fnv1a(h, name, strlen(name) + 1);
+        h = fnv1a(h, driver, strlen(driver) + 1);
+        h = fnv1a(h, source, length);
+        h = fnv1a(h, options, strlen(options) + 1);
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/aes-%016llx.clbin", dir ? dir : ".", h);
+        paths[i] = path;
+        binaries[i] = fileExists(path) ? loadBinaryFile(path, &sizes[i]) : NULL;
+        cached = cached && binaries[i] != NULL;
+    }
 
-    printf("Initializing OpenCL\n");
-#ifdef APPLE
-    int gpu = 1;
-    err = clGetDeviceIDs(NULL, gpu ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_CPU, 1, &device, NULL);
-    if (err != CL_SUCCESS) {
-        fprintf(stderr, "Error: Failed to create a device group!\n");
-        return EXIT_FAILURE;
+    cl_program prog = NULL;
+    if (cached) {
+        scoped_array<cl_int> binary_status(num);
+        prog = clCreateProgramWithBinary(ctx, num, devs, sizes, (const unsigned char **)binaries.get(), binary_status, &status);
+        bool loaded = prog != NULL && status == CL_SUCCESS;
+        for (unsigned i = 0; i < num; i++) {
+            loaded = loaded && binary_status[i] == CL_SUCCESS;
+        }
+        if (prog && (!loaded || clBuildProgram(prog, num, devs, options, NULL, NULL) != CL_SUCCESS)) {
+            clReleaseProgram(prog);
+            prog = NULL;
+        }
     }
-    // Create the context.
-    context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
-    checkError(status, "Failed to create context");
-#else 
-    if (!setCwdToExeDir()) {
-        return false;
+    for (unsigned i = 0; i < num; i++) {
+        delete[] binaries[i];
+    }
+    if (prog) {
+        for (unsigned i = 0; i < num; i++) {
+            fprintf(session_log, "Using cached program: %s\n", paths[i].c_str());
+        }
+        return prog;
+    }
+
+    prog = clCreateProgramWithSource(ctx, 1, &source, &length, &status);
+    checkError(status, "Failed to create program");
+    status = clBuildProgram(prog, num, devs, options, NULL, NULL);
+    if (status != CL_SUCCESS) {
+        size_t size = 0;
+        clGetProgramBuildInfo(prog, devs[0], CL_PROGRAM_BUILD_LOG, 0, NULL, &size);
+        scoped_array<char> log(size + 1);
+        log[0] = log[size] = '\0';
+        clGetProgramBuildInfo(prog, devs[0], CL_PROGRAM_BUILD_LOG, size, log, NULL);
+        fprintf(session_log, "%s\n", log.get());
+    }
+    checkError(status, "Failed to build program");
+
+    // the binaries come in the order of the program's devices
+    cl_uint count = 0;
+    if (clGetProgramInfo(prog, CL_PROGRAM_NUM_DEVICES, sizeof(count), &count, NULL) != CL_SUCCESS || count == 0) {
+        return prog;
+    }
+    scoped_array<cl_device_id> built(count);
+    scoped_array<size_t> built_sizes(count);
+    scoped_array<unsigned char *> built_binaries(count);
+    if (clGetProgramInfo(prog, CL_PROGRAM_DEVICES, count * sizeof(cl_device_id), built, NULL) != CL_SUCCESS ||
+        clGetProgramInfo(prog, CL_PROGRAM_BINARY_SIZES, count * sizeof(size_t), built_sizes, NULL) != CL_SUCCESS) {
+        return prog;
+    }
+    for (unsigned j = 0; j < count; j++) {
+        built_binaries[j] = built_sizes[j] > 0 ? new unsigned char[built_sizes[j]] : NULL;
+    }
+    if (clGetProgramInfo(prog, CL_PROGRAM_BINARIES, count * sizeof(unsigned char *), built_binaries, NULL) == CL_SUCCESS) {
+        for (unsigned j = 0; j < count; j++) {
+            for (unsigned i = 0; i < num && built_binaries[j]; i++) {
+                if (devs[i] == built[j]) {
+                    store_program(paths[i], built_binaries[j], built_sizes[j]);
+                    break;
+                }
+            }
+        }
+    }
+    for (unsigned j = 0; j < count; j++) {
+        delete[] built_binaries[j];
+    }
+    return prog;
+}
+
+/**
+ * The platform of the session, the first one whose name contains
+ * $AES_CL_PLATFORM when that is set. Otherwise an Altera platform and its
+ * .aocx binaries, else the first platform with a device, e.g. pocl on the
+ * host CPU, which builds aes.cl from source. NULL when there is none.
+ */
+cl_platform_id choose_platform() {
+    const char *wanted = getenv("AES_CL_PLATFORM");
+    if (wanted) {
+        return findPlatform(wanted);
+    }
+    cl_platform_id altera = findPlatform("Altera");
+    if (altera) {
+        return altera;
+    }
+    cl_uint num_platforms = 0;
+    if (clGetPlatformIDs(0, NULL, &num_platforms) != CL_SUCCESS || num_platforms == 0) {
+        return NULL;
     }
+    scoped_array<cl_platform_id> pids(num_platforms);
+    clGetPlatformIDs(num_platforms, pids, NULL);
+    for (unsigned i = 0; i < num_platforms; i++) {
+        cl_uint devices = 0;
+        if (clGetDeviceIDs(pids[i], CL_DEVICE_TYPE_ALL, 0, NULL, &devices) == CL_SUCCESS && devices > 0) {
+            return pids[i];
+        }
+    }
+    return NULL;
+}
+
+// Initializes the OpenCL objects of the session.
+bool init_opencl() {
+    cl_int status;
+
+    fprintf(session_log, "Initializing OpenCL\n");
+    // the binaries and aes.cl are looked up next to the executable
+    bool exe_dir = setCwdToExeDir();
 
     // Get the OpenCL platform.
-    platform = findPlatform("Altera");
+    platform = choose_platform();
     if (platform == NULL) {
-        printf("ERROR: Unable to find Altera OpenCL platform.\n");
+        fprintf(session_log, "ERROR: Unable to find an OpenCL platform.\n");
+        return false;
+    }
+    // Altera platforms (also named Intel FPGA) only run offline compiled binaries
+    std::string platform_name = getPlatformName(platform);
+    std::transform(platform_name.begin(), platform_name.end(), platform_name.begin(), tolower);
+    bool offline = platform_name.find("altera") != std::string::npos || platform_name.find("fpga") != std::string::npos;
+    if (offline && !exe_dir) {
         return false;
     }
+    bank_flags = offline ? CL_MEM_BANK_1_ALTERA : 0;
 
     // Query the available OpenCL device.
     device.reset(getDevices(platform, CL_DEVICE_TYPE_ALL, &num_devices));
-    printf("Platform: %s\n", getPlatformName(platform).c_str());
-    printf("Using %d device(s)\n", num_devices);
+    fprintf(session_log, "Platform: %s\n", getPlatformName(platform).c_str());
+    fprintf(session_log, "Using %d device(s)\n", num_devices);
     for (unsigned i = 0; i < num_devices; ++i) {
-        printf("  %s\n", getDeviceName(device[i]).c_str());
+        fprintf(session_log, "  %s\n", getDeviceName(device[i]).c_str());
     }
     // Create the context.
     context = clCreateContext(NULL, num_devices, device, NULL, NULL, &status);
     checkError(status, "Failed to create context");
-#endif
 
     // Create the program for all device. Use the first device as the
     // representative device (assuming all device are of the same type).
-#ifndef APPLE
-    std::string binary_file = getBoardBinaryFile("aes", device[0]);
-    printf("Using AOCX: %s\n", binary_file.c_str());
-    program = createProgramFromBinary(context, binary_file.c_str(), device, num_devices);
+    // The round count and the lines per wide work-item are fixed in the
+    // kernel at compile time, so each pair has its own binary (see the Makefile).
+    if (offline) {
+        std::string binary_name = rounds == 14 ? "aes_256" : rounds == 12 ? "aes_192" : "aes";
+        if (session_blocks != DEFAULT_BLOCKS) {
+            char suffix[16];
+            snprintf(suffix, sizeof(suffix), "_x%d", session_blocks);
+            binary_name += suffix;
+        }
+        std::string binary_file = getBoardBinaryFile(binary_name.c_str(), device[0]);
+        fprintf(session_log, "Using AOCX: %s\n", binary_file.c_str());
+        program = createProgramFromBinary(context, binary_file.c_str(), device, num_devices);
 
-    // Build the program that was just created.
-    status = clBuildProgram(program, 0, NULL, "", NULL, NULL);
-    checkError(status, "Failed to build program");
+        // Build the program that was just created.
+        status = clBuildProgram(program, 0, NULL, "", NULL, NULL);
+        checkError(status, "Failed to build program");
+    } else {
+        // Everywhere else the same pair are build options of aes.cl,
+        // built once per configuration and then loaded from the cache.
+        size_t length = 0;
+        scoped_array<unsigned char> source(fileExists("aes.cl") ? loadBinaryFile("aes.cl", &length) : NULL);
+        if (source == NULL) {
+            fprintf(session_log, "ERROR: Unable to read aes.cl.\n");
+            return false;
+        }
+        char options[64];
+        snprintf(options, sizeof(options), "-DROUND=%d -DBLOCKS=%d", rounds, session_blocks);
+        fprintf(session_log, "Building aes.cl with %s\n", options);
+        program = build_program_cached(context, num_devices, device, (const char *)source.get(), length, options);
+    }
 
     //Create per-device objects.
     queue.reset(num_devices);
-    kernel.reset(num_devices);
+    write_queue.reset(num_devices);
+    read_queue.reset(num_devices);
+    kernel.reset(num_devices * NUM_KERNELS);
     for(unsigned i = 0; i < num_devices; ++i) {
-        // Command queue.
+        // Command queues, transfers each way and kernels run side by side.
         queue[i] = clCreateCommandQueue(context, device[i], CL_QUEUE_PROFILING_ENABLE, &status);
         checkError(status, "Failed to create command queue");
+        write_queue[i] = clCreateCommandQueue(context, device[i], CL_QUEUE_PROFILING_ENABLE, &status);
+        checkError(status, "Failed to create write queue");
+        read_queue[i] = clCreateCommandQueue(context, device[i], CL_QUEUE_PROFILING_ENABLE, &status);
+        checkError(status, "Failed to create read queue");
 
-        // Kernel.
-        const char *kernel_name = mode;
-        kernel[i] = clCreateKernel(program, kernel_name, &status);
-        checkError(status, "Failed to create kernel");
+        // Kernels, every mode is ready before the first request.
+        for (unsigned k = 0; k < NUM_KERNELS; k++) {
+            kernel[k * num_devices + i] = clCreateKernel(program, kernel_names[k], &status);
+            checkError(status, "Failed to create kernel %s", kernel_names[k]);
+        }
     }
-#else
-    char *source = 0;
-    size_t length = 0;
-    LoadTextFromFile("aes.cl", &source, &length);
-    const char *kernel_name = mode;
-    program = clCreateProgramWithSource(context, 1, (const char **) & source, NULL, &err);
-
-    // Build the program that was just created.
-    status = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
-    checkError(status, "Failed to build program");
 
-    queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
-    kernel = clCreateKernel(program, kernel_name, &status);
-#endif
+    // The keys never need more than MAX_KEY_SCHEDULE bytes, every device
+    // gets its own so that they can all run at once.
+    streams.reset(num_devices);
+    for (unsigned i = 0; i < num_devices; ++i) {
+        streams[i].key = clCreateBuffer(context, CL_MEM_READ_ONLY | bank_flags, MAX_KEY_SCHEDULE, NULL, &status);
+        checkError(status, "Failed to create buffer for input B");
+        streams[i].tweak = clCreateBuffer(context, CL_MEM_READ_ONLY | bank_flags, MAX_KEY_SCHEDULE, NULL, &status);
+        checkError(status, "Failed to create buffer for the tweak key");
+        streams[i].keys = streams[i].ids = NULL;
+        streams[i].keys_bytes = streams[i].ids_bytes = 0;
+        for (int s = 0; s < STREAM_SLOTS; s++) {
+            streams[i].a[s] = streams[i].c[s] = NULL;
+            streams[i].a_bytes[s] = streams[i].c_bytes[s] = 0;
+        }
+        streams[i].first = streams[i].lines = streams[i].chunk = streams[i].chunks = 0;
+        streams[i].rate = 0;
+    }
+    return true;
+}
+
+// The session kernel for the current mode on device i.
+cl_kernel find_kernel(unsigned i) {
+    for (unsigned k = 0; k < NUM_KERNELS; k++) {
+        if (strcmp(mode, kernel_names[k]) == 0) {
+            return kernel[k * num_devices + i];
+        }
+    }
+    return NULL;
+}
+
+// Grows a session buffer to at least bytes, the contents are not kept.
+bool ensure_buffer(cl_mem *buf, size_t *have, size_t bytes, cl_mem_flags flags) {
+    cl_int status;
+    if (*buf && *have >= bytes) {
+        return true;
+    }
+    if (*buf) {
+        clReleaseMemObject(*buf);
+    }
+    *buf = clCreateBuffer(context, flags | bank_flags, bytes, NULL, &status);
+    checkError(status, "Failed to create buffer");
+    *have = bytes;
+    return true;
+}
 
-    // allocate device memory
-    fpga_a = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_BANK_1_ALTERA, size * MAX_WIDTH * sizeof(unsigned char), NULL, &status);
-    checkError(status, "Failed to create buffer for input A");
+// The single work-item kernels loop over the lines themselves.
+static bool single_work_item() {
+    return strstr(mode, "_pipe") != NULL;
+}
 
-    fpga_b = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_BANK_1_ALTERA, MAX_WIDTH * 11 * sizeof(unsigned char), NULL, &status);
-    checkError(status, "Failed to create buffer for input B");
+// The wide kernels take session_blocks lines per work-item.
+static bool wide_kernel() {
+    return strstr(mode, "_wide") != NULL;
+}
 
-    // move stuff into OpenCL device
-    for (unsigned i = 0; i < num_devices; i++) {
-        // move stuff into opencl device
-        status = clEnqueueWriteBuffer(queue[i], fpga_a, CL_FALSE, 0, size * MAX_WIDTH * sizeof(unsigned char), input, 0, NULL, NULL);
-        checkError(status, "Failed to transfer input A");
+// The local kernels run whole work-groups of LOCAL_GROUP.
+static bool local_kernel() {
+    return strstr(mode, "_local") != NULL;
+}
+
+// The batch kernels look the key of every line up in a table.
+static bool batch_kernel() {
+    return strstr(mode, "_batch") != NULL;
+}
 
-        status = clEnqueueWriteBuffer(queue[i], fpga_b, CL_FALSE, 0, MAX_WIDTH * 11 * sizeof(unsigned char), key, 0, NULL, NULL);
-        checkError(status, "Failed to transfer input B");
+// Sets the kernel arguments of device i for the lines in data, first is the
+// first of them in the request and chain holds the cbc ciphertext.
+static void set_chunk_args(unsigned i, cl_kernel k, cl_mem data, cl_mem chain, size_t first, size_t lines) {
+    cl_int status;
+    unsigned argi = 0;
 
-        clFinish(queue[i]);
+    status = clSetKernelArg(k, argi++, sizeof(cl_mem), &data);
+    checkError(status, "Failed to set argument %d", argi - 1);
 
-        cl_event kernel_event;
-        unsigned argi = 0;
+    status = clSetKernelArg(k, argi++, sizeof(cl_mem), batch_kernel() ? &streams[i].keys : &streams[i].key);
+    checkError(status, "Failed to set argument %d", argi - 1);
 
-        // set arguments
-        status = clSetKernelArg(kernel[i], argi++, sizeof(cl_mem), &fpga_a);
+    if (batch_kernel()) {
+        // the line keys hold the share of the device
+        cl_ulong line = first - streams[i].first;
+        status = clSetKernelArg(k, argi++, sizeof(cl_mem), &streams[i].ids);
         checkError(status, "Failed to set argument %d", argi - 1);
 
-        status = clSetKernelArg(kernel[i], argi++, sizeof(cl_mem), &fpga_b);
+        status = clSetKernelArg(k, argi++, sizeof(cl_ulong), &line);
         checkError(status, "Failed to set argument %d", argi - 1);
+    }
 
-        const size_t global_work_size = size;
-        // invoke the opencl kernel
-        status = clEnqueueNDRangeKernel(queue[i], kernel[i], 1, NULL, &global_work_size, NULL, 0, NULL, &kernel_event);
-        checkError(status, "Failed to launch kernel");
-        // wait for all kernels to finish
-        clWaitForEvents(num_devices, &kernel_event);
-        clReleaseEvent(kernel_event);
-        // get the result back from the device
-        status = clEnqueueReadBuffer(queue[i], fpga_a, CL_TRUE, 0, size * MAX_WIDTH * sizeof(unsigned char), output, 0, NULL, NULL);
-        checkError(status, "Failed to read output list");
-        clFinish(queue[i]);
+    if (single_work_item() || wide_kernel() || local_kernel()) {
+        cl_uint count = lines;
+        status = clSetKernelArg(k, argi++, sizeof(cl_uint), &count);
+        checkError(status, "Failed to set argument %d", argi - 1);
+    }
+
+    if (local_kernel()) {
+        cl_uint copies = LOCAL_COPIES;
+        status = clSetKernelArg(k, argi++, sizeof(cl_uint), &copies);
+        checkError(status, "Failed to set argument %d", argi - 1);
+
+        status = clSetKernelArg(k, argi++, LOCAL_COPIES * 256 * sizeof(cl_uint), NULL);
+        checkError(status, "Failed to set argument %d", argi - 1);
+
+        status = clSetKernelArg(k, argi++, MAX_WIDTH * (rounds + 1) * sizeof(unsigned char), NULL);
+        checkError(status, "Failed to set argument %d", argi - 1);
+    }
+
+    if (strcmp(mode, "ctr_xcrypt") == 0) {
+        // the counter of the chunk's first line, carried into the high half
+        cl_ulong lo = counter_lo + first;
+        cl_ulong hi = counter_hi + (lo < counter_lo ? 1 : 0);
+        status = clSetKernelArg(k, argi++, sizeof(cl_ulong), &hi);
+        checkError(status, "Failed to set argument %d", argi - 1);
+
+        status = clSetKernelArg(k, argi++, sizeof(cl_ulong), &lo);
+        checkError(status, "Failed to set argument %d", argi - 1);
+    }
+
+    if (strcmp(mode, "cbc_decrypt") == 0) {
+        status = clSetKernelArg(k, argi++, sizeof(cl_mem), &chain);
+        checkError(status, "Failed to set argument %d", argi - 1);
+    }
+
+    if (strncmp(mode, "xts_", 4) == 0) {
+        cl_ulong unit = xts_unit0 + first / xts_group;
+        status = clSetKernelArg(k, argi++, sizeof(cl_mem), &streams[i].tweak);
+        checkError(status, "Failed to set argument %d", argi - 1);
+
+        status = clSetKernelArg(k, argi++, sizeof(cl_ulong), &unit);
+        checkError(status, "Failed to set argument %d", argi - 1);
+
+        status = clSetKernelArg(k, argi++, 2 * sizeof(cl_ulong), NULL);
+        checkError(status, "Failed to set argument %d", argi - 1);
     }
-    return true;
 }
 
-void cleanup() {
-#ifndef APPLE
-    for(unsigned i = 0; i < num_devices; ++i) {
-        if(kernel && kernel[i]) {
-            clReleaseKernel(kernel[i]);
+// Starts the kernel of the current mode over lines lines on device i.
+static cl_int launch(unsigned i, cl_kernel k, size_t lines, const cl_event *wait, cl_event *done) {
+    if (single_work_item()) {
+        return clEnqueueTask(queue[i], k, wait ? 1 : 0, wait, done);
+    }
+    size_t global_work_size = lines;
+    const size_t *local_work_size = NULL;
+    const size_t local_group = LOCAL_GROUP;
+    if (wide_kernel()) {
+        global_work_size = (lines + session_blocks - 1) / session_blocks;
+    } else if (local_kernel()) {
+        // whole work-groups, the kernel skips the lines past the end
+        global_work_size = (lines + LOCAL_GROUP - 1) / LOCAL_GROUP * LOCAL_GROUP;
+        local_work_size = &local_group;
+    } else if (strncmp(mode, "xts_", 4) == 0) {
+        // xts runs one work-group per data unit
+        local_work_size = &xts_group;
+    }
+    return clEnqueueNDRangeKernel(queue[i], k, 1, NULL, &global_work_size, local_work_size, wait ? 1 : 0, wait, done);
+}
+
+// Uploads the keys of the request to device i, returns the event of the last upload.
+static cl_event write_keys(unsigned i) {
+    cl_int status;
+    cl_event done;
+    bool xts = strncmp(mode, "xts_", 4) == 0;
+    if (batch_kernel()) {
+        // the whole key table and the line keys of the device's share
+        device_stream &d = streams[i];
+        ensure_buffer(&d.keys, &d.keys_bytes, batch_num_keys * MAX_KEY_SCHEDULE, CL_MEM_READ_ONLY);
+        ensure_buffer(&d.ids, &d.ids_bytes, (d.lines > 0 ? d.lines : 1) * sizeof(cl_uint), CL_MEM_READ_ONLY);
+        status = clEnqueueWriteBuffer(write_queue[i], d.keys, CL_FALSE, 0, batch_num_keys * MAX_KEY_SCHEDULE, batch_keys, 0, NULL, NULL);
+        checkError(status, "Failed to transfer the key table");
+
+        status = clEnqueueWriteBuffer(write_queue[i], d.ids, CL_FALSE, 0, d.lines * sizeof(cl_uint), &batch_ids[d.first], 0, NULL, &done);
+        checkError(status, "Failed to transfer the line keys");
+        clFlush(write_queue[i]);
+        return done;
+    }
+    status = clEnqueueWriteBuffer(write_queue[i], streams[i].key, CL_FALSE, 0, MAX_WIDTH * (rounds + 1) * sizeof(unsigned char), key, 0, NULL, xts ? NULL : &done);
+    checkError(status, "Failed to transfer input B");
+
+    if (xts) {
+        status = clEnqueueWriteBuffer(write_queue[i], streams[i].tweak, CL_FALSE, 0, MAX_WIDTH * (rounds + 1) * sizeof(unsigned char), tweak_key, 0, NULL, &done);
+        checkError(status, "Failed to transfer input C");
+    }
+    clFlush(write_queue[i]);
+    return done;
+}
+
+/**
+ * Sets device i up for count lines from first: the chunks, the slot
+ * buffers and, for cbc, the lines that chain into each chunk. Every device
+ * is prepared before any starts, the downloads of one device may overwrite
+ * the line in front of the next one's share.
+ */
+static void stream_prepare(unsigned i, size_t first, size_t count) {
+    device_stream &d = streams[i];
+    bool cbc = strcmp(mode, "cbc_decrypt") == 0;
+    // an xts chunk holds whole data units
+    size_t chunk = chunk_lines;
+    if (strncmp(mode, "xts_", 4) == 0) {
+        chunk = chunk < xts_group ? xts_group : chunk - chunk % xts_group;
+    }
+    d.first = first;
+    d.lines = count;
+    d.chunk = chunk;
+    d.chunks = (count + chunk - 1) / chunk;
+    if (d.chunks == 0) {
+        return;
+    }
+
+    // the slots hold one chunk each, so requests of any length fit
+    size_t slot_lines = count < chunk ? count : chunk;
+    for (int s = 0; s < STREAM_SLOTS; s++) {
+        ensure_buffer(&d.a[s], &d.a_bytes[s], slot_lines * MAX_WIDTH * sizeof(unsigned char), CL_MEM_READ_WRITE);
+        // cbc_decrypt reads the iv and the ciphertext from their own buffer, a
+        // work-item may not overwrite the line the next one chains from
+        if (cbc) {
+            ensure_buffer(&d.c[s], &d.c_bytes[s], (slot_lines + 1) * MAX_WIDTH * sizeof(unsigned char), CL_MEM_READ_ONLY);
         }
-        if(queue && queue[i]) {
-            clReleaseCommandQueue(queue[i]);
+    }
+
+    // the download of the chunk before may overwrite these lines first
+    if (cbc) {
+        d.chain.reset(d.chunks * MAX_WIDTH);
+        for (size_t c = 0; c < d.chunks; c++) {
+            size_t line = first + c * chunk;
+            memcpy(&d.chain[c * MAX_WIDTH], line == 0 ? chain_iv : input + (line - 1) * MAX_WIDTH, MAX_WIDTH);
         }
     }
-#else
-    clReleaseKernel(kernel);
-    clReleaseCommandQueue(queue);
-#endif
-    if(program) {
-        clReleaseProgram(program);
+}
+
+/**
+ * Starts streaming the share of device i a chunk at a time,
+ * stream_finish() waits for it. Chunk c uses slot c % STREAM_SLOTS:
+ * its upload waits for the download that last used the slot, its kernel
+ * waits for the upload and its download for the kernel. Uploads, kernels
+ * and downloads sit on their own queues, so while chunk c runs, chunk c + 1
+ * uploads and chunk c - 1 downloads.
+ */
+static void stream_start(unsigned i) {
+    cl_int status;
+    device_stream &d = streams[i];
+    bool cbc = strcmp(mode, "cbc_decrypt") == 0;
+    size_t first = d.first, count = d.lines, chunk = d.chunk;
+    if (d.chunks == 0) {
+        return;
     }
-    if(context) {
-        clReleaseContext(context);
+
+    cl_event keys_ready = write_keys(i);
+    d.write_event.reset(d.chunks);
+    d.kernel_event.reset(d.chunks);
+    d.read_event.reset(d.chunks);
+    cl_kernel k = find_kernel(i);
+    for (size_t c = 0; c < d.chunks; c++) {
+        int s = c % STREAM_SLOTS;
+        size_t line = first + c * chunk;
+        size_t lines = count - c * chunk < chunk ? count - c * chunk : chunk;
+        size_t bytes = lines * MAX_WIDTH * sizeof(unsigned char);
+        // the slot is free again once its last chunk is downloaded
+        const cl_event *slot_free = c >= STREAM_SLOTS ? &d.read_event[c - STREAM_SLOTS] : NULL;
+
+        if (cbc) {
+            status = clEnqueueWriteBuffer(write_queue[i], d.c[s], CL_FALSE, 0, MAX_WIDTH * sizeof(unsigned char), &d.chain[c * MAX_WIDTH], slot_free ? 1 : 0, slot_free, NULL);
+            checkError(status, "Failed to transfer iv");
+
+            status = clEnqueueWriteBuffer(write_queue[i], d.c[s], CL_FALSE, MAX_WIDTH, bytes, input + line * MAX_WIDTH, 0, NULL, &d.write_event[c]);
+            checkError(status, "Failed to transfer input C");
+        } else {
+            status = clEnqueueWriteBuffer(write_queue[i], d.a[s], CL_FALSE, 0, bytes, input + line * MAX_WIDTH, slot_free ? 1 : 0, slot_free, &d.write_event[c]);
+            checkError(status, "Failed to transfer input A");
+        }
+
+        set_chunk_args(i, k, d.a[s], d.c[s], line, lines);
+        status = launch(i, k, lines, &d.write_event[c], &d.kernel_event[c]);
+        checkError(status, "Failed to launch kernel");
+
+        status = clEnqueueReadBuffer(read_queue[i], d.a[s], CL_FALSE, 0, bytes, output + line * MAX_WIDTH, 1, &d.kernel_event[c], &d.read_event[c]);
+        checkError(status, "Failed to read output list");
+
+        // start the work now, the queues would otherwise wait for the last chunk
+        clFlush(write_queue[i]);
+        clFlush(queue[i]);
+        clFlush(read_queue[i]);
     }
+    clReleaseEvent(keys_ready);
 }
 
-#ifdef APPLE
-static int LoadTextFromFile(const char *file_name, char **result_string, size_t *string_len) {
-    int fd;
-    unsigned file_len;
-    struct stat file_status;
-    int ret;
-
-    *string_len = 0;
-    fd = open(file_name, O_RDONLY);
-    if (fd == -1) {
-        printf("Error opening file %s\n", file_name);
-        return -1;
+/**
+ * Waits for the share of device i and updates its rate from the device
+ * time between the first upload and the last download.
+ */
+static void stream_finish(unsigned i) {
+    device_stream &d = streams[i];
+    if (d.chunks == 0) {
+        return;
     }
-    ret = fstat(fd, &file_status);
-    if (ret) {
-        printf("Error reading status for file %s\n", file_name);
-        return -1;
+    clFinish(read_queue[i]);
+    cl_ulong begin = 0, end = 0;
+    clGetEventProfilingInfo(d.write_event[0], CL_PROFILING_COMMAND_START, sizeof(begin), &begin, NULL);
+    clGetEventProfilingInfo(d.read_event[d.chunks - 1], CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+    if (end > begin) {
+        double rate = d.lines / ((end - begin) * 1e-9);
+        d.rate = d.rate > 0 ? (d.rate + rate) / 2 : rate;
+    }
+    for (size_t c = 0; c < d.chunks; c++) {
+        transfer_time += event_time(d.write_event[c]) + event_time(d.read_event[c]);
+        kernel_time += event_time(d.kernel_event[c]);
+        clReleaseEvent(d.write_event[c]);
+        clReleaseEvent(d.kernel_event[c]);
+        clReleaseEvent(d.read_event[c]);
     }
-    file_len = file_status.st_size;
+    d.chunks = 0;
+}
 
-    *result_string = (char*)calloc(file_len + 1, sizeof(char));
-    ret = read(fd, *result_string, file_len);
-    if (!ret) {
-        printf("Error reading from file %s\n", file_name);
-        return -1;
+/**
+ * Splits count lines over the devices in proportion to their measured
+ * rates, evenly until every device has one. Shares are whole multiples of
+ * step lines, the last device takes what is left.
+ */
+static void shard(size_t count, size_t step, size_t *share) {
+    double total = 0;
+    bool measured = true;
+    for (unsigned i = 0; i < num_devices; i++) {
+        total += streams[i].rate;
+        measured = measured && streams[i].rate > 0;
+    }
+    size_t steps = count / step;
+    size_t given = 0;
+    for (unsigned i = 0; i + 1 < num_devices; i++) {
+        size_t n = measured ? (size_t)(steps * (streams[i].rate / total)) : steps / num_devices;
+        share[i] = n * step;
+        given += n * step;
     }
+    share[num_devices - 1] = count - given;
+}
+
+/**
+ * Runs device i over an fpga_alloc() buffer in place: unmapped for the
+ * kernel, mapped back for the host. ready is the event of the key upload.
+ */
+static bool mapped_lines(unsigned i, host_buffer *hb, cl_event ready) {
+    cl_int status;
 
-    close(fd);
+    status = clEnqueueUnmapMemObject(queue[i], hb->mem, hb->ptr, 0, NULL, NULL);
+    checkError(status, "Failed to unmap host buffer");
 
-    *string_len = file_len;
-    return 0;
+    cl_kernel k = find_kernel(i);
+    cl_event done;
+    set_chunk_args(i, k, hb->mem, NULL, 0, size);
+    status = launch(i, k, size, &ready, &done);
+    checkError(status, "Failed to launch kernel");
+
+    void *ptr = clEnqueueMapBuffer(queue[i], hb->mem, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, hb->bytes, 0, NULL, NULL, &status);
+    checkError(status, "Failed to map host buffer");
+    kernel_time += event_time(done);
+    clReleaseEvent(done);
+    // the caller keeps using the old pointer
+    if (ptr != hb->ptr) {
+        fprintf(session_log, "ERROR: host buffer moved when mapped again\n");
+        return false;
+    }
+    return true;
 }
 
-// High-resolution timer.
-double getCurrentTimestamp() {
-#ifdef _WIN32 // Windows
-    // Use the high-resolution performance counter.
+// Moves the data through the session kernel picked by mode.
+bool run_opencl() {
+    double start = getCurrentTimestamp();
+    transfer_time = 0;
+    kernel_time = 0;
+
+    // data in an fpga_alloc() buffer needs no transfers, except for cbc
+    // whose kernel reads the ciphertext from a buffer of its own. It is
+    // not split, shared-memory boards have a single device.
+    if (strcmp(mode, "cbc_decrypt") != 0 && input == output) {
+        host_buffer *hb = find_host_buffer(input, size * MAX_WIDTH * sizeof(unsigned char));
+        if (hb) {
+            // device 0 takes the whole request
+            streams[0].first = 0;
+            streams[0].lines = size;
+            cl_event keys_ready = write_keys(0);
+            bool ok = mapped_lines(0, hb, keys_ready);
+            clReleaseEvent(keys_ready);
+            call_time = getCurrentTimestamp() - start;
+            return ok;
+        }
+    }
 
-    static LARGE_INTEGER ticks_per_second = {};
-    if (ticks_per_second.QuadPart == 0) {
-    // First call - get the frequency.
-        QueryPerformanceFrequency(&ticks_per_second);
+    // every device streams its share at the same time, xts shares hold
+    // whole data units
+    scoped_array<size_t> share(num_devices);
+    shard(size, strncmp(mode, "xts_", 4) == 0 ? xts_group : 1, share);
+    size_t first = 0;
+    for (unsigned i = 0; i < num_devices; i++) {
+        stream_prepare(i, first, share[i]);
+        first += share[i];
+    }
+    for (unsigned i = 0; i < num_devices; i++) {
+        stream_start(i);
+    }
+    for (unsigned i = 0; i < num_devices; i++) {
+        stream_finish(i);
     }
+    call_time = getCurrentTimestamp() - start;
+    return true;
+}
 
-    LARGE_INTEGER counter;
-    QueryPerformanceCounter(&counter);
+// GHASH work split: lines per work-item and work-items per work-group (a power of two)
+#define GHASH_RUN 16
+#define GHASH_GROUP 64
 
-    double seconds = double(counter.QuadPart) / double(ticks_per_second.QuadPart);
-    return seconds;
-#else         // Linux
-    timespec a;
-    clock_gettime(CLOCK_MONOTONIC, &a);
-    return (double(a.tv_nsec) * 1.0e-9) + double(a.tv_sec);
-#endif
+// h^e in GF(2^128) by square and multiply
+static void ghash_power(const unsigned char *h, unsigned long long e, unsigned char *out) {
+    unsigned char base[MAX_WIDTH];
+    memcpy(base, h, MAX_WIDTH);
+    memset(out, 0, MAX_WIDTH);
+    out[0] = 0x80;  // the GCM bit order puts 1 in the top bit
+    for (; e; e >>= 1) {
+        if (e & 1) {
+            gfMultiply(out, base, out);
+        }
+        gfMultiply(base, base, base);
+    }
+}
+
+static void load_block(cl_ulong *dst, const unsigned char *src) {
+    dst[0] = 0;
+    dst[1] = 0;
+    for (int i = 0; i < 8; i++) {
+        dst[0] = (dst[0] << 8) | src[i];
+        dst[1] = (dst[1] << 8) | src[8 + i];
+    }
 }
 
-void _checkError(int line, const char *file, cl_int error, const char *msg, ...) {
-    // If not successful
-    if(error != CL_SUCCESS) {
-        // Print line and file
-        printf("ERROR: ");
-        printf("\nLocation: %s:%d\n", file, line);
+/**
+ * Every work-group hashes GHASH_RUN * GHASH_GROUP lines into one partial,
+ * the partials are chained here with H^(lines per group). Leading zero
+ * lines do not change GHASH, so the data is padded at the front.
+ */
+bool run_ghash(int num_of_lines, const unsigned char *data, const unsigned char *h, unsigned char *y) {
+    cl_int status;
+    double start = getCurrentTimestamp();
+    const int per_group = GHASH_RUN * GHASH_GROUP;
+    int pad = (per_group - num_of_lines % per_group) % per_group;
+    int groups = (num_of_lines + pad) / per_group;
+    size_t bytes = (size_t)(num_of_lines + pad) * MAX_WIDTH;
+
+    // hpow[0] = H, hpow[1 + k] = H^(GHASH_RUN * 2^k)
+    int levels = 0;
+    while ((1 << levels) < GHASH_GROUP) {
+        levels++;
+    }
+    scoped_array<cl_ulong> hpow(2 * (levels + 1));
+    unsigned char p[MAX_WIDTH];
+    load_block(&hpow[0], h);
+    for (int k = 0; k < levels; k++) {
+        ghash_power(h, (unsigned long long)GHASH_RUN << k, p);
+        load_block(&hpow[2 + 2 * k], p);
+    }
 
-        // Print custom message.
-        va_list vl;
-        va_start(vl, msg);
-        vprintf(msg, vl);
-        printf("\n");
-        va_end(vl);
+    // data in a, powers of H in c, partials in d
+    ensure_buffer(&fpga_a, &fpga_a_bytes, bytes, CL_MEM_READ_WRITE);
+    ensure_buffer(&fpga_c, &fpga_c_bytes, 2 * (levels + 1) * sizeof(cl_ulong), CL_MEM_READ_ONLY);
+    ensure_buffer(&fpga_d, &fpga_d_bytes, 2 * groups * sizeof(cl_ulong), CL_MEM_WRITE_ONLY);
+    cl_kernel k = find_kernel(0);
 
-        // Cleanup and bail.
-        cleanup();
-        exit(error);
+    // staging memory from the arena, aligned for the DMA engine
+    unsigned char *zeros = arenaAlloc(pad * MAX_WIDTH + 1);
+    if (zeros == NULL) {
+        return false;
+    }
+    memset(zeros, 0, pad * MAX_WIDTH + 1);
+    if (pad > 0) {
+        status = clEnqueueWriteBuffer(queue[0], fpga_a, CL_FALSE, 0, pad * MAX_WIDTH, zeros, 0, NULL, NULL);
+        checkError(status, "Failed to transfer GHASH padding");
+    }
+    status = clEnqueueWriteBuffer(queue[0], fpga_a, CL_FALSE, pad * MAX_WIDTH, (size_t)num_of_lines * MAX_WIDTH, data, 0, NULL, NULL);
+    checkError(status, "Failed to transfer GHASH data");
+    status = clEnqueueWriteBuffer(queue[0], fpga_c, CL_FALSE, 0, 2 * (levels + 1) * sizeof(cl_ulong), hpow, 0, NULL, NULL);
+    checkError(status, "Failed to transfer powers of H");
+
+    unsigned argi = 0;
+    cl_uint run = GHASH_RUN;
+    status = clSetKernelArg(k, argi++, sizeof(cl_mem), &fpga_a);
+    checkError(status, "Failed to set argument %d", argi - 1);
+    status = clSetKernelArg(k, argi++, sizeof(cl_mem), &fpga_c);
+    checkError(status, "Failed to set argument %d", argi - 1);
+    status = clSetKernelArg(k, argi++, sizeof(cl_mem), &fpga_d);
+    checkError(status, "Failed to set argument %d", argi - 1);
+    status = clSetKernelArg(k, argi++, sizeof(cl_uint), &run);
+    checkError(status, "Failed to set argument %d", argi - 1);
+    status = clSetKernelArg(k, argi++, 2 * GHASH_GROUP * sizeof(cl_ulong), NULL);
+    checkError(status, "Failed to set argument %d", argi - 1);
+
+    const size_t global_work_size = (size_t)groups * GHASH_GROUP;
+    const size_t local_work_size = GHASH_GROUP;
+    status = clEnqueueNDRangeKernel(queue[0], k, 1, NULL, &global_work_size, &local_work_size, 0, NULL, NULL);
+    checkError(status, "Failed to launch kernel");
+
+    cl_ulong *partials = (cl_ulong *)arenaAlloc(2 * groups * sizeof(cl_ulong));
+    if (partials == NULL) {
+        clFinish(queue[0]);
+        arenaFree(zeros, pad * MAX_WIDTH + 1);
+        return false;
+    }
+    status = clEnqueueReadBuffer(queue[0], fpga_d, CL_TRUE, 0, 2 * groups * sizeof(cl_ulong), partials, 0, NULL, NULL);
+    checkError(status, "Failed to read GHASH partials");
+    // the queue is in order, the padding is on the device by now
+    arenaFree(zeros, pad * MAX_WIDTH + 1);
+
+    // Y = Y * H^(per_group) ^ P_g over the groups in order
+    unsigned char step[MAX_WIDTH];
+    ghash_power(h, per_group, step);
+    memset(y, 0, MAX_WIDTH);
+    for (int g = 0; g < groups; g++) {
+        gfMultiply(y, step, y);
+        for (int i = 0; i < 8; i++) {
+            y[i] ^= (unsigned char)(partials[2 * g] >> (56 - 8 * i));
+            y[8 + i] ^= (unsigned char)(partials[2 * g + 1] >> (56 - 8 * i));
+        }
+    }
+    arenaFree(partials, 2 * groups * sizeof(cl_ulong));
+    call_time = getCurrentTimestamp() - start;
+    return true;
+}
+
+// Releases the session, the next request sets it up again.
+void cleanup() {
+    for(int b = 0; b < MAX_HOST_BUFFERS; ++b) {
+        if(host_buffers[b].mem) {
+            release_host_buffer(&host_buffers[b]);
+        }
+    }
+    for(unsigned i = 0; i < num_devices * NUM_KERNELS; ++i) {
+        if(kernel && kernel[i]) {
+            clReleaseKernel(kernel[i]);
+            kernel[i] = NULL;
+        }
+    }
+    for(unsigned i = 0; i < num_devices; ++i) {
+        if(queue && queue[i]) {
+            clReleaseCommandQueue(queue[i]);
+            queue[i] = NULL;
+        }
+        if(write_queue && write_queue[i]) {
+            clReleaseCommandQueue(write_queue[i]);
+            write_queue[i] = NULL;
+        }
+        if(read_queue && read_queue[i]) {
+            clReleaseCommandQueue(read_queue[i]);
+            read_queue[i] = NULL;
+        }
+    }
+    if(fpga_a) {
+        clReleaseMemObject(fpga_a);
+        fpga_a = NULL;
+    }
+    if(fpga_c) {
+        clReleaseMemObject(fpga_c);
+        fpga_c = NULL;
+    }
+    if(fpga_d) {
+        clReleaseMemObject(fpga_d);
+        fpga_d = NULL;
+    }
+    fpga_a_bytes = fpga_c_bytes = fpga_d_bytes = 0;
+    for(unsigned i = 0; streams && i < num_devices; ++i) {
+        if(streams[i].key) {
+            clReleaseMemObject(streams[i].key);
+        }
+        if(streams[i].tweak) {
+            clReleaseMemObject(streams[i].tweak);
+        }
+        if(streams[i].keys) {
+            clReleaseMemObject(streams[i].keys);
+        }
+        if(streams[i].ids) {
+            clReleaseMemObject(streams[i].ids);
+        }
+        for(int s = 0; s < STREAM_SLOTS; ++s) {
+            if(streams[i].a[s]) {
+                clReleaseMemObject(streams[i].a[s]);
+            }
+            if(streams[i].c[s]) {
+                clReleaseMemObject(streams[i].c[s]);
+            }
+        }
+    }
+    streams.reset();
+    if(program) {
+        clReleaseProgram(program);
+        program = NULL;
+    }
+    if(context) {
+        clReleaseContext(context);
+        context = NULL;
     }
+    session_open = false;
 }
-#endif
\ No newline at end of file